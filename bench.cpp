@@ -0,0 +1,351 @@
+
+//インクルードファイル指定
+#include <opencv2/opencv.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <limits>
+#include <random>
+#include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
+#include <boost/optional.hpp>
+
+#include "../utils/include/types.hpp"
+#include "../utils/include/image.hpp"
+#include "../utils/include/range.hpp"
+#include "../guess_img/include/guess.hpp"
+#include "../guess_img/include/blocked_guess.hpp"
+#include "../guess_img/include/correlation.hpp"
+#include "../guess_img/include/correlation_s.hpp"
+#include "../utils/include/backtrace.hpp"
+#include "cost_table.hpp"
+#include "grid.hpp"
+#include "interactive_guess.hpp"
+#include "trace.hpp"
+#include "transposition.hpp"
+
+using namespace procon;
+
+
+// 計測結果の一行
+struct BenchResult
+{
+    size_t div;
+    std::string layout, predictor, target;
+    size_t reps;
+    double minMs, meanMs;
+    double score;       // 結果の配置のcalcAllValue。配置を返さないものはNaN
+};
+
+
+// 断片の大きさ(ピクセル)
+constexpr size_t tileSize = 32;
+
+
+/** 滑らかな模様に雑音を加えた画像を作り、断片をシャッフルして問題にします。
+問題はprocon形式のPPMとして一時ファイルに書き出し、Problem::getで読み込みます。
+*/
+boost::optional<utils::Problem> make_problem(size_t div, unsigned seed)
+{
+    const size_t w = div * tileSize,
+                 h = div * tileSize;
+
+    cv::Mat org(h, w, CV_8UC3);
+    cv::RNG rng(seed);
+    for(size_t y = 0; y < h; ++y)
+        for(size_t x = 0; x < w; ++x){
+            auto& px = org.at<cv::Vec3b>(y, x);
+            px[0] = cv::saturate_cast<uchar>(128 + 100 * std::sin(x * 0.021 + y * 0.013) + rng.gaussian(8));
+            px[1] = cv::saturate_cast<uchar>(128 + 100 * std::cos(x * 0.008 - y * 0.017) + rng.gaussian(8));
+            px[2] = cv::saturate_cast<uchar>(128 + 100 * std::sin(x * 0.015 * std::cos(y * 0.004)) + rng.gaussian(8));
+        }
+
+    std::vector<size_t> perm(div * div);
+    for(size_t i = 0; i < perm.size(); ++i) perm[i] = i;
+    std::shuffle(perm.begin(), perm.end(), std::mt19937(seed));
+
+    cv::Mat shuffled(h, w, CV_8UC3);
+    for(size_t k = 0; k < perm.size(); ++k){
+        const cv::Rect src((perm[k] % div) * tileSize, (perm[k] / div) * tileSize, tileSize, tileSize),
+                       dst((k % div) * tileSize, (k / div) * tileSize, tileSize, tileSize);
+        org(src).copyTo(shuffled(dst));
+    }
+
+    const std::string path = utils::format("bench_%.ppm", div);
+    {
+        std::ofstream os(path, std::ios::binary);
+        os << "P6\n# " << div << " " << div << "\n# 16\n# 1 1\n" << w << " " << h << "\n255\n";
+        for(size_t y = 0; y < h; ++y)
+            for(size_t x = 0; x < w; ++x){
+                auto& px = shuffled.at<cv::Vec3b>(y, x);
+                const char rgb[3] = {static_cast<char>(px[2]), static_cast<char>(px[1]), static_cast<char>(px[0])};
+                os.write(rgb, 3);
+            }
+    }
+
+    auto pb = utils::Problem::get(path);
+    std::remove(path.c_str());
+    return pb;
+}
+
+
+/** 固定(赤)とグループ(青)の配置のパターン
+    fixed:  一番上の行を固定
+    group:  左上の断片を固定し、中ほどの2x2をグループに
+    groups: groupに加えて、右下の1x3をもう一つのグループに
+*/
+modify::Grid<modify::TileState> make_layout(std::string const & layout, size_t div)
+{
+    modify::Grid<modify::TileState> st(div, div);
+
+    if(layout == "fixed"){
+        for(size_t j = 0; j < div; ++j)
+            st(0, j).setFixed();
+        return st;
+    }
+
+    st(0, 0).setFixed();
+
+    const size_t c = div / 2 - 1;
+    for(size_t i = c; i < c + 2; ++i)
+        for(size_t j = c; j < c + 2; ++j)
+            st(i, j).setGroup(0);
+
+    if(layout == "groups")
+        for(size_t j = div - 3; j < div; ++j)
+            st(div - 1, j).setGroup(1);
+
+    return st;
+}
+
+
+// fをreps回実行して、最短と平均の時間(ミリ秒)を返す
+std::pair<double, double> measure(size_t reps, std::function<void()> const & f)
+{
+    double minMs = std::numeric_limits<double>::infinity(), sum = 0;
+    for(size_t r = 0; r < reps; ++r){
+        const auto t = std::chrono::steady_clock::now();
+        f();
+        const double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t).count();
+        minMs = std::min(minMs, ms);
+        sum += ms;
+    }
+
+    return std::make_pair(minMs, sum / reps);
+}
+
+
+template <typename BinFunc>
+void bench_predictor(std::vector<BenchResult>& results, utils::Problem const & pb, std::vector<std::vector<utils::ImageID>> const & before,
+                     size_t reps, size_t maxGroupsDiv, std::string const & predName, BinFunc const & pred)
+{
+    const size_t div = pb.div_x();
+    const modify::ImgMap index(before);
+
+    auto add = [&](std::string const & layout, std::string const & target, std::pair<double, double> t, double score){
+        results.push_back(BenchResult{div, layout, predName, target, reps, t.first, t.second, score});
+    };
+
+    boost::optional<modify::CostTable> table;
+    auto t = measure(reps, [&]{ table = boost::none; table.emplace(before, pred); });
+    add("-", "CostTable", t, std::numeric_limits<double>::quiet_NaN());
+
+    double score = 0;
+    t = measure(reps, [&]{ score = modify::calcAllValue(index, pred); });
+    add("-", "calcAllValue(pred)", t, score);
+
+    modify::TileMap tiles(div, div);
+    for(size_t k = 0; k < tiles.size(); ++k)
+        tiles[k] = table->catalog().number(index[k]);
+    t = measure(reps, [&]{ score = modify::calcAllValue(tiles, *table); });
+    add("-", "calcAllValue(table)", t, score);
+
+    for(std::string layout: {"fixed", "group", "groups"}){
+        if(layout == "groups" && div > maxGroupsDiv)
+            continue;
+
+        const auto states = make_layout(layout, div);
+        const auto gp = modify::make_guess_problem(index, states, table->catalog());
+
+        if(gp.groups.empty()){
+            modify::TileMap filled;
+            t = measure(reps, [&]{ filled = modify::fill_remain_tile(gp.map, gp.remain, *table); });
+            add(layout, "fill_remain_tile", t, modify::calcAllValue(filled, *table));
+        }
+
+        std::tuple<double, modify::TileMap> res;
+        t = measure(reps, [&]{ res = modify::position_bfs(gp.groups.begin(), gp.groups.end(), gp.map, gp.remain, pb, *table); });
+        add(layout, "position_bfs", t, std::get<0>(res));
+
+        modify::ImgMap guessed;
+        t = measure(reps, [&]{ guessed = modify::interactive_guess(index, states, pb, *table); });
+        add(layout, "interactive_guess", t, modify::calcAllValue(guessed, *table));
+
+        modify::GuessOption beamOpt;
+        beamOpt.mode = modify::SearchMode::beam;
+        t = measure(reps, [&]{ guessed = modify::interactive_guess(index, states, pb, *table, beamOpt); });
+        add(layout, "interactive_guess(beam)", t, modify::calcAllValue(guessed, *table));
+
+        // 同じ状態での推定し直し。一回目で表が埋まるので、二回目以降は末端の評価が表から引かれる
+        modify::TranspositionTable tt(64 << 20);
+        modify::GuessOption ttOpt;
+        ttOpt.tt = &tt;
+        t = measure(reps, [&]{ guessed = modify::interactive_guess(index, states, pb, *table, ttOpt); });
+        add(layout, "interactive_guess(tt)", t, modify::calcAllValue(guessed, *table));
+
+        modify::GuessOption refineOpt;
+        refineOpt.refine = true;
+        t = measure(reps, [&]{ guessed = modify::interactive_guess(index, states, pb, *table, refineOpt); });
+        add(layout, "interactive_guess(refine)", t, modify::calcAllValue(guessed, *table));
+
+        // 表の構築を含めた、spaceキー一回分
+        t = measure(reps, [&]{ guessed = modify::interactive_guess(index, states, pb, modify::CostTable(before, pred)); });
+        add(layout, "interactive_guess+table", t, modify::calcAllValue(guessed, *table));
+    }
+}
+
+
+/** position_bfsと同じ配置を返すはずの探索(position_bnbと、スレッド数を変えたposition_bfs_parallel)を、
+評価値の同じ配置の選び方まで含めて比べます。食い違いを標準エラーに書き出し、その数を返します。
+*/
+template <typename BinFunc>
+size_t verify_predictor(utils::Problem const & pb, std::vector<std::vector<utils::ImageID>> const & before,
+                        size_t maxGroupsDiv, std::string const & predName, BinFunc const & pred)
+{
+    const size_t div = pb.div_x();
+    const modify::ImgMap index(before);
+    const modify::CostTable table(before, pred);
+
+    size_t nMismatch = 0;
+    for(std::string layout: {"fixed", "group", "groups"}){
+        if(layout == "groups" && div > maxGroupsDiv)
+            continue;
+
+        const auto gp = modify::make_guess_problem(index, make_layout(layout, div), table.catalog());
+        const auto bg = gp.groups.begin(),
+                   ed = gp.groups.end();
+
+        const auto expected = modify::position_bfs(bg, ed, gp.map, gp.remain, pb, table);
+
+        auto check = [&](std::string const & target, std::tuple<double, modify::TileMap> const & res){
+            if(std::get<1>(res) == std::get<1>(expected))
+                return;
+
+            std::fprintf(stderr, "mismatch: div %zu, layout %s, predictor %s, %s: score %.9g, position_bfs %.9g\n",
+                         div, layout.c_str(), predName.c_str(), target.c_str(), std::get<0>(res), std::get<0>(expected));
+            ++nMismatch;
+        };
+
+        {
+            const modify::PlacementBound bound(modify::collect_ids(bg, ed, gp.map, gp.remain), table);
+            modify::Incumbent incumbent;
+            check("position_bnb", modify::position_bnb(bg, ed, gp.map, gp.remain, pb, table, bound, incumbent));
+        }
+
+        for(size_t nThreads: {1, 2, 3, 8}){
+            check(utils::format("position_bfs_parallel(%)", nThreads),
+                  modify::position_bfs_parallel(bg, ed, gp.map, gp.remain, pb, table, nThreads));
+            check(utils::format("position_bfs_parallel(%, bnb)", nThreads),
+                  modify::position_bfs_parallel(bg, ed, gp.map, gp.remain, pb, table, nThreads, modify::SearchMode::branchAndBound));
+        }
+    }
+
+    return nMismatch;
+}
+
+
+void print_csv(std::vector<BenchResult> const & results)
+{
+    std::printf("div,layout,predictor,target,reps,min_ms,mean_ms,score\n");
+    for(auto& r: results)
+        std::printf("%zu,%s,%s,%s,%zu,%.4f,%.4f,%.9g\n", r.div, r.layout.c_str(), r.predictor.c_str(), r.target.c_str(),
+                    r.reps, r.minMs, r.meanMs, r.score);
+}
+
+
+void print_json(std::vector<BenchResult> const & results)
+{
+    std::printf("[\n");
+    for(size_t i = 0; i < results.size(); ++i){
+        auto& r = results[i];
+        std::printf("  {\"div\": %zu, \"layout\": \"%s\", \"predictor\": \"%s\", \"target\": \"%s\", \"reps\": %zu, "
+                    "\"min_ms\": %.4f, \"mean_ms\": %.4f, \"score\": ",
+                    r.div, r.layout.c_str(), r.predictor.c_str(), r.target.c_str(), r.reps, r.minMs, r.meanMs);
+
+        if(std::isnan(r.score)) std::printf("null");
+        else                    std::printf("%.9g", r.score);
+
+        std::printf("}%s\n", i + 1 < results.size() ? "," : "");
+    }
+    std::printf("]\n");
+}
+
+
+// 合成した問題でinteractive_guessまわりの時間を計る
+// 使い方: ./bench [--json] [--verify] [--reps N] [--min-div N] [--max-div N] [--groups-max-div N]
+// --verifyなら時間は計らず、各探索がposition_bfsと同じ配置を返すかだけを調べ、食い違いがあれば1で終わる
+int main(int argc, char* argv[])
+{
+    bool json = false, verify = false;
+    size_t reps = 3, minDiv = 4, maxDiv = 16, maxGroupsDiv = 8;
+
+    for(int i = 1; i < argc; ++i){
+        const std::string arg = argv[i];
+        auto next = [&](){ PROCON_ENFORCE(i + 1 < argc, "Error: missing value for " + arg); return std::stoul(argv[++i]); };
+
+        if(arg == "--json")                 json = true;
+        else if(arg == "--verify")          verify = true;
+        else if(arg == "--reps")            reps = next();
+        else if(arg == "--min-div")         minDiv = next();
+        else if(arg == "--max-div")         maxDiv = next();
+        else if(arg == "--groups-max-div")  maxGroupsDiv = next();
+        else{
+            std::fprintf(stderr, "unknown option: %s\n", arg.c_str());
+            return 1;
+        }
+    }
+
+    // 計測には一回以上の実行が要り、分割数は倍にしていくので0では終わらない。
+    // また、make_layoutの形は4x4以上の盤面にしか置けない
+    if(reps == 0 || minDiv < 4){
+        std::fprintf(stderr, "--reps must be at least 1 and --min-div at least 4\n");
+        return 1;
+    }
+
+    std::vector<BenchResult> results;
+    size_t nMismatch = 0;
+    for(size_t div = minDiv; div <= maxDiv; div *= 2){
+        auto p_opt = make_problem(div, 1);
+        PROCON_ENFORCE(static_cast<bool>(p_opt), "Error: cannot load the synthetic problem.");
+        auto& pb = *p_opt;
+
+        // 推定の出発点はtest.cppと同じく、blocked_guessの結果にする
+        const auto before = blocked_guess::guess(pb, guess::Correlator(pb));
+
+        if(verify){
+            nMismatch += verify_predictor(pb, before, maxGroupsDiv, "correlation", guess::Correlator(pb));
+            nMismatch += verify_predictor(pb, before, maxGroupsDiv, "correlation_s", guess_s::Correlator(pb));
+            continue;
+        }
+
+        bench_predictor(results, pb, before, reps, maxGroupsDiv, "correlation", guess::Correlator(pb));
+        bench_predictor(results, pb, before, reps, maxGroupsDiv, "correlation_s", guess_s::Correlator(pb));
+    }
+
+    if(verify){
+        std::printf("verify: %zu mismatches\n", nMismatch);
+        return nMismatch == 0 ? 0 : 1;
+    }
+
+    if(json) print_json(results);
+    else     print_csv(results);
+
+    PROCON_TRACE_EXPORT("bench_trace.json");
+
+    return 0;
+}
@@ -0,0 +1,174 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <tuple>
+#include <vector>
+
+#include "cost_table.hpp"
+#include "grid.hpp"
+
+
+namespace procon { namespace modify {
+
+
+/** wで立っているビットのうち最も下位のものの位置。wが0なら64を返します
+*/
+inline std::size_t lowest_bit(std::uint64_t w)
+{
+    if(w == 0)
+        return 64;
+
+  #if defined(__GNUC__)
+    return __builtin_ctzll(w);
+  #else
+    std::size_t n = 0;
+    while(!(w & 1)){ w >>= 1; ++n; }
+    return n;
+  #endif
+}
+
+
+/** 256マスまでの盤面の各マスを1ビットで表す集合
+マスは行優先の通し番号 i * cols + j で表します。
+*/
+class Bitboard
+{
+  public:
+    static constexpr std::size_t capacity = 256;
+
+
+    Bitboard() : _w{{0, 0, 0, 0}} {}
+
+
+    bool test(std::size_t k) const { return (_w[k / 64] >> (k % 64)) & 1; }
+    void set(std::size_t k) { _w[k / 64] |= std::uint64_t(1) << (k % 64); }
+    void reset(std::size_t k) { _w[k / 64] &= ~(std::uint64_t(1) << (k % 64)); }
+
+
+    /** [b, e)のマスをすべて立てます
+    */
+    void set_range(std::size_t b, std::size_t e)
+    {
+        for(std::size_t w = b / 64; w * 64 < e; ++w){
+            const std::size_t lo = std::max(b, w * 64) - w * 64,
+                              hi = std::min(e, w * 64 + 64) - w * 64;
+            const std::uint64_t m = (hi == 64 ? ~std::uint64_t(0) : (std::uint64_t(1) << hi) - 1)
+                                  & ~((std::uint64_t(1) << lo) - 1);
+            _w[w] |= m;
+        }
+    }
+
+
+    bool empty() const { return (_w[0] | _w[1] | _w[2] | _w[3]) == 0; }
+
+
+    Bitboard& operator&=(Bitboard const & rhs)
+    {
+        for(std::size_t i = 0; i < 4; ++i) _w[i] &= rhs._w[i];
+        return *this;
+    }
+
+
+    /** 全体をnビット下位へずらしたもの。(b >> n).test(k) == b.test(k + n)
+    */
+    Bitboard operator>>(std::size_t n) const
+    {
+        Bitboard dst;
+        const std::size_t q = n / 64, r = n % 64;
+        for(std::size_t i = 0; i + q < 4; ++i){
+            dst._w[i] = _w[i + q] >> r;
+            if(r && i + q + 1 < 4)
+                dst._w[i] |= _w[i + q + 1] << (64 - r);
+        }
+
+        return dst;
+    }
+
+
+    /** 立っているマスを小さい順にfに渡します
+    */
+    template <typename F>
+    void foreach(F f) const
+    {
+        for(std::size_t i = 0; i < 4; ++i)
+            for(std::uint64_t w = _w[i]; w; w &= w - 1)
+                f(i * 64 + lowest_bit(w));
+    }
+
+
+  private:
+    std::array<std::uint64_t, 4> _w;
+};
+
+
+/** 空いている(noTileの)マスの集合
+*/
+inline Bitboard free_cells(Grid<TileNo> const & map, TileNo noTile)
+{
+    Bitboard dst;
+    for(std::size_t k = 0; k < map.size(); ++k)
+        if(map[k] == noTile)
+            dst.set(k);
+
+    return dst;
+}
+
+
+/** 盤面の大きさに合わせて前もって変換したグループの形
+各断片の位置を、先頭の断片(アンカー)からの通し番号の差として持ちます。
+グループの先頭は行優先で最初の断片なので、差はすべて0以上です。
+*/
+class GroupMask
+{
+  public:
+    template <typename Group>
+    GroupMask(Group const & g, std::size_t rows, std::size_t cols)
+    : _offsets(), _anchors()
+    {
+        std::ptrdiff_t maxDi = 0, minDj = 0, maxDj = 0;
+        for(auto& e: g){
+            const auto di = std::get<1>(e)[0],
+                       dj = std::get<1>(e)[1];
+
+            maxDi = std::max(maxDi, di);
+            minDj = std::min(minDj, dj);
+            maxDj = std::max(maxDj, dj);
+            _offsets.push_back(di * static_cast<std::ptrdiff_t>(cols) + dj);
+        }
+
+        // はみ出さずに置けるアンカーの範囲
+        const std::ptrdiff_t nRows = static_cast<std::ptrdiff_t>(rows) - maxDi,
+                             jBegin = -minDj,
+                             jEnd = static_cast<std::ptrdiff_t>(cols) - maxDj;
+
+        for(std::ptrdiff_t i = 0; i < nRows; ++i)
+            if(jBegin < jEnd)
+                _anchors.set_range(i * cols + jBegin, i * cols + jEnd);
+    }
+
+
+    /** 空いているマスがfreeのとき、グループを置けるアンカーの集合
+    */
+    Bitboard fit_anchors(Bitboard const & free) const
+    {
+        Bitboard dst = _anchors;
+        for(auto d: _offsets){
+            dst &= free >> d;
+            if(dst.empty())
+                break;
+        }
+
+        return dst;
+    }
+
+
+  private:
+    std::vector<std::ptrdiff_t> _offsets;
+    Bitboard _anchors;
+};
+
+
+}}
@@ -1 +1,3 @@
-g++ -Wall -O3 -rdynamic -std=c++1y test.cpp -o app `pkg-config --cflags --libs opencv`
\ No newline at end of file
+g++ -Wall -O3 -rdynamic -std=c++1y test.cpp -o app `pkg-config --cflags --libs opencv`
+g++ -Wall -O3 -rdynamic -std=c++1y replay.cpp -o replay `pkg-config --cflags --libs opencv`
+g++ -Wall -O3 -rdynamic -std=c++1y bench.cpp -o bench `pkg-config --cflags --libs opencv`
\ No newline at end of file
@@ -5,7 +5,11 @@
 #include <memory>
 #include <vector>
 #include <boost/optional.hpp>
-#include <stack>
+#include <deque>
+#include <cstdint>
+#include <unordered_map>
+#include <functional>
+#include <string>
 #include <opencv2/opencv.hpp>
 #include <opencv/highgui.h>
 
@@ -13,6 +17,9 @@
 #include "../utils/include/image.hpp"
 #include "../utils/include/range.hpp"
 #include "../utils/include/exception.hpp"
+#include "grid.hpp"
+#include "tile_view.hpp"
+#include "trace.hpp"
 
 
 namespace procon { namespace modify {
@@ -153,87 +160,643 @@ struct TileState
 
     void reset() { _state = 0; }
     void setFixed() { _state = 1; }
-    void setGroup(size_t gid) { _state = gid + 2; }
+    void setGroup(size_t gid) { _state = static_cast<std::uint8_t>(gid + 2); }
+
+    bool operator==(TileState const & rhs) const { return _state == rhs._state; }
+
+    /** ファイルに書き出すための1バイトの表現
+    */
+    std::uint8_t raw() const { return _state; }
+    static TileState fromRaw(std::uint8_t v) { TileState st; st._state = v; return st; }
 
   private:
-    size_t _state;
+    std::uint8_t _state;
 };
 
 
-//マウス操作のコールバック関数へ渡す引数用の構造体 
-struct Parameter
+/** 元に戻す/やり直しのための、一つの操作の差分
+*/
+struct Operation
 {
-    struct Saved
+    enum class Kind : std::uint8_t
     {
-        template <typename A, typename B>
-        Saved(A&& idx, B&& tst)
-        : index(std::forward<A>(idx)), tileState(std::forward<B>(tst))
-        {}
-
-        std::vector<std::vector<utils::ImageID>> index;
-        std::vector<std::vector<TileState>> tileState;
+        swap,       // 画像と状態を入れ替え
+        swapImage,  // 画像だけを入れ替え(推定結果の適用)
+        state,      // 断片の状態をbeforeからafterへ変更
+        shift,      // 画像全体のローテーション
     };
 
+    Kind kind;
+    bool isRow;     // shiftのとき、行方向かどうか
+    bool forward;   // shiftのとき、先頭の行(列)を末尾へ送るかどうか
+    std::uint16_t idx1[2];
+    std::uint16_t idx2[2];
+    TileState before;
+    TileState after;
+
+
+    static Operation makeSwap(Kind k, utils::Index2D const & a, utils::Index2D const & b)
+    {
+        Operation op = {};
+        op.kind = k;
+        op.idx1[0] = a[0]; op.idx1[1] = a[1];
+        op.idx2[0] = b[0]; op.idx2[1] = b[1];
+        return op;
+    }
+
+
+    static Operation makeState(utils::Index2D const & a, TileState bf, TileState af)
+    {
+        Operation op = {};
+        op.kind = Kind::state;
+        op.idx1[0] = a[0]; op.idx1[1] = a[1];
+        op.before = bf;
+        op.after = af;
+        return op;
+    }
+
+
+    static Operation makeShift(bool isRow, bool forward)
+    {
+        Operation op = {};
+        op.kind = Kind::shift;
+        op.isRow = isRow;
+        op.forward = forward;
+        return op;
+    }
+
+
+    utils::Index2D index1() const { return utils::makeIndex2D(idx1[0], idx1[1]); }
+    utils::Index2D index2() const { return utils::makeIndex2D(idx2[0], idx2[1]); }
+};
+
+
+/** Parameterの並びと状態を変える操作と、元に戻す/やり直しを受け取ります
+*/
+struct HistoryObserver
+{
+    virtual ~HistoryObserver() {}
+
+    virtual void on_operation(Operation const & op) = 0;
+    virtual void on_save() = 0;
+    virtual void on_restore() = 0;
+    virtual void on_redo() = 0;
+};
+
 
-    Parameter(utils::DividedImage const & pb,
+//マウス操作のコールバック関数へ渡す引数用の構造体 
+struct Parameter
+{
+    // 一回の操作(ジェスチャ)で行われた差分の列
+    using Gesture = std::vector<Operation>;
+
+
+    /** 断片の画素は、atlasから参照で引きます
+    */
+    Parameter(std::shared_ptr<TileAtlas const> atlas,
               std::vector<std::vector<utils::ImageID>> const & index,
               char const * title)
-    : swpImage(pb.clone(), index),
+    : swpImage(atlas, Grid<utils::ImageID>(index)),
       mouseEvSq(),
-      tileState(std::vector<std::vector<TileState>>(pb.div_y(), std::vector<TileState>(pb.div_x(), TileState()))),
       windowName(title),
-      _history(){}
+      _tileState(atlas->div_y(), atlas->div_x()),
+      _undo(),
+      _redo(),
+      _nOps(0),
+      _historyLimit(1 << 18),
+      _replaying(false),
+      _observer(nullptr),
+      _scorer(),
+      _score(0),
+      _seamDown(atlas->div_y(), atlas->div_x(), 0),
+      _seamRight(atlas->div_y(), atlas->div_x(), 0),
+      _heat(false),
+      _status(),
+      _statusDirty(true),
+      _display(),
+      _dirty(atlas->div_y(), atlas->div_x(), 0),
+      _dirtyList(),
+      _revision(0){}
+
+
+    /** imgをindexの並びで一度だけ合成したものを、元画像にします
+    */
+    Parameter(utils::DividedImage const & img,
+              std::vector<std::vector<utils::ImageID>> const & index,
+              char const * title)
+    : Parameter(std::make_shared<TileAtlas const>(img, index), index, title) {}
 
-    utils::SwappedImage swpImage;
+    static constexpr int statusHeight = 24;     // 画像の下に表示する状態表示欄の高さ
+
+    ArrangedImage swpImage;         // 書き換えはswap_elementかapply_indexで行うこと
     std::deque<MouseEvent> mouseEvSq;
-    std::vector<std::vector<TileState>> tileState;
     char const * windowName;
 
-    private: std::stack<Saved> _history;
-    public:
+  private:
+    Grid<TileState> _tileState;         // swpImageの並びの中の位置(physical)で引く
+
+    std::deque<Gesture> _undo;
+    std::vector<Gesture> _redo;
+    std::size_t _nOps;              // _undoと_redoが持つ差分の総数
+    std::size_t _historyLimit;      // _nOpsの上限
+    bool _replaying;                // restore/redo中は差分を記録しない
+    HistoryObserver* _observer;     // 通知しない場合はnullptr
+
+    std::function<double(utils::ImageID, utils::ImageID, utils::Direction)> _scorer;
+    double _score;                              // 全継ぎ目の評価値の和
+    // 継ぎ目の評価値。ずらしても計算し直さずに済むよう、並びの中の位置(physical)で引き、
+    // 端と反対側の端の間の継ぎ目も持つ(_scoreには含めない)
+    Grid<double> _seamDown;                     // physicalで(i, j)と(i+1, j)の継ぎ目の評価値
+    Grid<double> _seamRight;                    // physicalで(i, j)と(i, j+1)の継ぎ目の評価値
+    bool _heat;                                 // 継ぎ目の評価値を色で重ねて表示するかどうか
+    std::string _status;
+    bool _statusDirty;
+
+    cv::Mat _display;                           // 前回合成した表示用画像
+    Grid<std::uint8_t> _dirty;                  // 再合成が必要な断片
+    std::vector<utils::Index2D> _dirtyList;
+
+    std::size_t _revision;                      // 並びか状態が変わるたびに増える
+
+  public:
+
+
+    TileState const & state(size_t i, size_t j) const { return _tileState[swpImage.physical(i, j)]; }
+
+
+    /** すべての断片の状態を、swpImage.get_index()と同じ位置で返します
+    */
+    Grid<TileState> states() const
+    {
+        Grid<TileState> dst(swpImage.div_y(), swpImage.div_x());
+        utils::DividedImage::foreach(swpImage, [&](size_t i, size_t j){ dst(i, j) = state(i, j); });
+        return dst;
+    }
+
+
+    /** 並びか断片の状態が変わるたびに増える番号です。
+    別スレッドで推定している間に画像が変更されたかどうかを調べるのに使います。
+    */
+    std::size_t revision() const { return _revision; }
+
+
+    /** (i, j)の断片の状態をfで書き換えます
+    */
+    template <typename F>
+    void modify_state(size_t i, size_t j, F f)
+    {
+        TileState& st = _tileState[swpImage.physical(i, j)];
+        const TileState before = st;
+        f(st);
+
+        if(before == st)
+            return;
+
+        record(Operation::makeState(utils::makeIndex2D(i, j), before, st));
+        mark_dirty(i, j);
+        ++_revision;
+    }
 
 
     void swap_element(utils::Index2D const & idx1, utils::Index2D const & idx2)
     {
-        swpImage.swap_element(idx1, idx2);
-        std::swap(tileState[idx1[0]][idx1[1]], tileState[idx2[0]][idx2[1]]);
+        record(Operation::makeSwap(Operation::Kind::swap, idx1, idx2));
+        swap_impl(idx1, idx2);
+    }
+
+
+    /** 画像全体を一つずらします。
+    isRowなら行方向、forwardなら先頭の行(列)が末尾へ移動します。
+    並びは書き換えないので、かかる時間は端の継ぎ目の数と再描画だけです。
+    */
+    void shift(bool isRow, bool forward)
+    {
+        record(Operation::makeShift(isRow, forward));
+        shift_impl(isRow, forward);
     }
 
 
-    cv::Mat cvMat() const
+    /** 推定結果などで、画像の並びを丸ごと置き換えます。
+    置き換えは変化した断片についての入れ替えの列として記録されます。
+    */
+    void apply_index(Grid<utils::ImageID> const & index)
     {
-        auto dup = swpImage.clone();
+        std::unordered_map<utils::ImageID, utils::Index2D> pos;
+        utils::DividedImage::foreach(swpImage, [&](size_t i, size_t j){
+            pos.emplace(swpImage.at(i, j), utils::makeIndex2D(i, j));
+        });
 
+        // 巡回置換を分解して、一回の入れ替えで少なくとも一つの断片を正しい位置へ置く
         utils::DividedImage::foreach(swpImage, [&](size_t i, size_t j){
-            if(tileState[i][j].isFixed()){
-                dup.get_element(i, j).cvMat() *= 0.5;
-                dup.get_element(i, j).cvMat() +=  cv::Scalar(0, 0, 255) * 0.5;
-            }
-            else if(tileState[i][j].isGrouped()){
-                dup.get_element(i, j).cvMat() *= 0.5;
-                dup.get_element(i, j).cvMat() +=  groupedColor[tileState[i][j].groupId()] * 0.5;
-            }
+            const auto now = swpImage.at(i, j);
+            if(now == index(i, j))
+                return;
+
+            const auto p = utils::makeIndex2D(i, j),
+                       q = pos.at(index(i, j));
+
+            pos[now] = q;
+            pos[index(i, j)] = p;
+
+            record(Operation::makeSwap(Operation::Kind::swapImage, p, q));
+            swap_image(p, q);
+        });
+    }
+
+
+    /** 記録しておいた操作を、新しい操作として行います
+    */
+    void perform(Operation const & op)
+    {
+        record(op);
+        replay(op);
+    }
+
+
+    /** 以降の操作をobsに通知します。nullptrで通知を止めます。
+    obsは、通知を止めるかこのParameterが破棄されるまで生存していなければなりません。
+    */
+    void set_observer(HistoryObserver* obs) { _observer = obs; }
+
+
+    /** 差分を保持する上限数を設定します。
+    超えた場合は古い操作から忘れます。
+    */
+    void set_history_limit(std::size_t maxOps)
+    {
+        _historyLimit = maxOps;
+        shrink_history();
+    }
+
+
+    std::size_t history_size() const { return _nOps; }
+
+
+    /** 継ぎ目の評価に使う関数を設定し、全体の評価値を計算し直します。
+    predは、このParameterより長く生存していなければなりません。
+    */
+    template <typename BinFunc>
+    void set_scorer(BinFunc const & pred)
+    {
+        _scorer = [&pred](utils::ImageID const & a, utils::ImageID const & b, utils::Direction dir){
+            return pred(a, b, dir);
+        };
+
+        _score = 0;
+        utils::DividedImage::foreach(swpImage, [&](size_t i, size_t j){
+            _seamDown(i, j) = _seamRight(i, j) = 0;
         });
+        utils::DividedImage::foreach(swpImage, [&](size_t i, size_t j){ update_seams(i, j); });
+        _statusDirty = true;
+    }
+
+
+    /** 現在の並びの評価値(calcAllValueと同じもの)を返します。
+    入れ替えのたびに影響を受ける継ぎ目だけを計算し直して保っています。
+    */
+    double score() const { return _score; }
+
+
+    /** 継ぎ目の評価値の色分け表示を切り替えます
+    */
+    void toggle_heat()
+    {
+        _heat = !_heat;
+        utils::DividedImage::foreach(swpImage, [&](size_t i, size_t j){ mark_dirty(i, j); });
+    }
+
+
+    /** 状態表示欄に、評価値と並べて表示する文字列を設定します
+    */
+    void set_status(std::string const & str)
+    {
+        if(str == _status) return;
+
+        _status = str;
+        _statusDirty = true;
+    }
+
+
+    void mark_dirty(size_t i, size_t j)
+    {
+        if(_dirty(i, j)) return;
+
+        _dirty(i, j) = 1;
+        _dirtyList.emplace_back(utils::makeIndex2D(i, j));
+    }
 
-        return dup.cvMat();
+
+    bool is_dirty() const { return _display.empty() || _statusDirty || !_dirtyList.empty(); }
+
+
+    /** 表示用の画像を返します。
+    前回の呼び出しから変更のあった断片だけを再合成するので、変更がなければ何もしません。
+    */
+    cv::Mat cvMat()
+    {
+        if(!is_dirty())
+            return _display;
+
+        PROCON_TRACE_SCOPE("redraw");
+        PROCON_TRACE_VALUE("redrawn tiles", _display.empty() ? _dirty.size() : _dirtyList.size());
+
+        if(_display.empty()){
+            _display = cv::Mat(swpImage.height() + statusHeight, swpImage.width(),
+                               swpImage.atlas()->type(), cv::Scalar(0, 0, 0));
+            utils::DividedImage::foreach(swpImage, [&](size_t i, size_t j){ mark_dirty(i, j); });
+            _statusDirty = true;
+        }
+
+        for(auto& idx: _dirtyList){
+            compose_tile(idx[0], idx[1]);
+            _dirty[idx] = 0;
+        }
+        _dirtyList.clear();
+
+        if(_statusDirty){
+            compose_status();
+            _statusDirty = false;
+        }
+
+        return _display;
     }
 
 
+    /** 新しい操作の始まりを記録します。
+    以降restoreまでに行われた変更は、まとめて一回で元に戻されます。
+    */
     void save()
     {
-        _history.emplace(swpImage.get_index(), tileState);
+        if(_observer) _observer->on_save();
+
+        _undo.emplace_back();
+        for(auto& g: _redo) _nOps -= g.size();
+        _redo.clear();
+        shrink_history();
     }
 
 
+    /** 一つ前の操作を取り消します
+    */
     void restore()
     {
-        if (_history.empty()) return;
+        if (_undo.empty()) return;
+        if(_observer) _observer->on_restore();
+
+        Gesture g = std::move(_undo.back());
+        _undo.pop_back();
+
+        _replaying = true;
+        for(auto it = g.rbegin(); it != g.rend(); ++it)
+            revert(*it);
+        _replaying = false;
+
+        _redo.emplace_back(std::move(g));
+        mouseEvSq.clear();
+    }
+
+
+    /** restoreで取り消した操作をやり直します
+    */
+    void redo()
+    {
+        if (_redo.empty()) return;
+        if(_observer) _observer->on_redo();
 
-        auto& t = _history.top();
-        swpImage = utils::SwappedImage(swpImage.dividedImage(), t.index);
-        tileState = t.tileState;
+        Gesture g = std::move(_redo.back());
+        _redo.pop_back();
+
+        _replaying = true;
+        for(auto& op: g)
+            replay(op);
+        _replaying = false;
+
+        _undo.emplace_back(std::move(g));
         mouseEvSq.clear();
-        _history.pop();
+    }
+
+
+  private:
+    void record(Operation const & op)
+    {
+        if(_replaying)
+            return;
+
+        // 履歴に残らない操作も並びは変えるので、通知はする
+        if(_observer) _observer->on_operation(op);
+
+        if(_undo.empty())
+            return;
+
+        _undo.back().push_back(op);
+        ++_nOps;
+        shrink_history();
+    }
+
+
+    void shrink_history()
+    {
+        // 最新の操作は記録中なので残す
+        while(_nOps > _historyLimit && _undo.size() > 1){
+            _nOps -= _undo.front().size();
+            _undo.pop_front();
+        }
+    }
+
+
+    void replay(Operation const & op)
+    {
+        switch(op.kind){
+          case Operation::Kind::swap:
+            swap_impl(op.index1(), op.index2());
+            break;
+
+          case Operation::Kind::swapImage:
+            swap_image(op.index1(), op.index2());
+            break;
+
+          case Operation::Kind::state:
+            set_state(op.index1(), op.after);
+            break;
+
+          case Operation::Kind::shift:
+            shift_impl(op.isRow, op.forward);
+            break;
+        }
+    }
+
+
+    void revert(Operation const & op)
+    {
+        switch(op.kind){
+          case Operation::Kind::state:
+            set_state(op.index1(), op.before);
+            break;
+
+          case Operation::Kind::shift:
+            shift_impl(op.isRow, !op.forward);
+            break;
+
+          default:  // 入れ替えは自分自身が逆操作
+            replay(op);
+        }
+    }
+
+
+    void set_state(utils::Index2D const & idx, TileState st)
+    {
+        _tileState[swpImage.physical(idx[0], idx[1])] = st;
+        mark_dirty(idx[0], idx[1]);
+        ++_revision;
+    }
+
+
+    void swap_impl(utils::Index2D const & idx1, utils::Index2D const & idx2)
+    {
+        std::swap(_tileState[swpImage.physical(idx1[0], idx1[1])], _tileState[swpImage.physical(idx2[0], idx2[1])]);
+        swap_image(idx1, idx2);
+    }
+
+
+    void swap_image(utils::Index2D const & idx1, utils::Index2D const & idx2)
+    {
+        swpImage.swap_element(idx1, idx2);
+        ++_revision;
+        mark_dirty(idx1[0], idx1[1]);
+        mark_dirty(idx2[0], idx2[1]);
+        update_seams(idx1[0], idx1[1]);
+        update_seams(idx2[0], idx2[1]);
+    }
+
+
+    // (i, j)に接する継ぎ目の評価値を、端をまたぐものも含めて計算し直し、差分を全体の評価値に反映する
+    void update_seams(size_t i, size_t j)
+    {
+        if(!_scorer) return;
+
+        const std::size_t n = swpImage.div_y(),
+                          m = swpImage.div_x();
+
+        if(n > 1){
+            update_seam((i + n - 1) % n, j, true);
+            update_seam(i, j, true);
+        }
+        if(m > 1){
+            update_seam(i, (j + m - 1) % m, false);
+            update_seam(i, j, false);
+        }
+    }
+
+
+    // (i, j)と、その下(右)の断片との継ぎ目。最後の行(列)では、最初の行(列)との継ぎ目
+    double& seam(size_t i, size_t j, bool isDown)
+    {
+        return (isDown ? _seamDown : _seamRight)[swpImage.physical(i, j)];
+    }
+
+
+    double seam(size_t i, size_t j, bool isDown) const
+    {
+        return (isDown ? _seamDown : _seamRight)[swpImage.physical(i, j)];
+    }
+
+
+    void update_seam(size_t i, size_t j, bool isDown)
+    {
+        const std::size_t i2 = isDown ? (i + 1) % swpImage.div_y() : i,
+                          j2 = isDown ? j : (j + 1) % swpImage.div_x();
+        const bool inner = isDown ? i2 != 0 : j2 != 0;
+
+        double& s = seam(i, j, isDown);
+        const double v = _scorer(swpImage.at(i, j), swpImage.at(i2, j2), isDown ? utils::Direction::down : utils::Direction::right);
+        PROCON_TRACE_COUNT("predicate calls", 1);
+
+        if(inner){
+            _score += v - s;
+            _statusDirty = true;
+
+            if(_heat){
+                mark_dirty(i, j);
+                mark_dirty(i2, j2);
+            }
+        }
+        s = v;
+    }
+
+
+    // 継ぎ目の評価値を、平均の2倍を赤、0を緑とした色にする
+    cv::Scalar heat_color(double v) const
+    {
+        const std::size_t nSeams = (swpImage.div_y() - 1) * swpImage.div_x()
+                                 + swpImage.div_y() * (swpImage.div_x() - 1);
+        const double mean = nSeams ? _score / nSeams : 0;
+        const double t = mean > 0 ? std::min(std::max(v / (2 * mean), 0.0), 1.0) : 0.5;
+
+        return cv::Scalar(0, 255 * (1 - t), 255 * t);
+    }
+
+
+    void compose_status()
+    {
+        cv::Mat bar = _display(cv::Rect(0, swpImage.height(), swpImage.width(), statusHeight));
+        bar.setTo(cv::Scalar(0, 0, 0));
+
+        std::string text = _scorer ? utils::format("score: %", _score) : std::string();
+        if(!_status.empty())
+            text += (text.empty() ? "" : "  ") + _status;
+
+        cv::putText(bar, text, cv::Point(4, statusHeight - 7), cv::FONT_HERSHEY_SIMPLEX, 0.5, cv::Scalar(255, 255, 255), 1);
+    }
+
+
+    // ずれを変え、端をまたぐ継ぎ目が入れ替わった分だけ全体の評価値を直す
+    void shift_impl(bool isRow, bool forward)
+    {
+        const std::size_t n = isRow ? swpImage.div_y() : swpImage.div_x(),
+                          m = isRow ? swpImage.div_x() : swpImage.div_y();
+
+        auto edgeScore = [&](){
+            double sum = 0;
+            for(std::size_t k = 0; k < m; ++k)
+                sum += isRow ? seam(n - 1, k, true) : seam(k, n - 1, false);
+            return sum;
+        };
+
+        const double before = edgeScore();
+        swpImage.shift(isRow, forward);
+        _score += before - edgeScore();
+        _statusDirty = true;
+        ++_revision;
+
+        utils::DividedImage::foreach(swpImage, [&](size_t i, size_t j){ mark_dirty(i, j); });
+    }
+
+
+    void compose_tile(size_t i, size_t j)
+    {
+        cv::Mat const & src = swpImage.tile(i, j);
+        cv::Mat dst = _display(cv::Rect(j * src.cols, i * src.rows, src.cols, src.rows));
+        src.copyTo(dst);
+
+        auto& st = state(i, j);
+        if(st.isFixed()){
+            dst *= 0.5;
+            dst += cv::Scalar(0, 0, 255) * 0.5;
+        }
+        else if(st.isGrouped()){
+            dst *= 0.5;
+            dst += groupedColor[st.groupId()] * 0.5;
+        }
+
+        if(_heat && _scorer){
+            const int w = dst.cols - 1,
+                      h = dst.rows - 1;
+
+            if(i > 0)                       cv::line(dst, cv::Point(0, 0), cv::Point(w, 0), heat_color(seam(i-1, j, true)), 2);
+            if(i + 1 < swpImage.div_y())    cv::line(dst, cv::Point(0, h), cv::Point(w, h), heat_color(seam(i, j, true)), 2);
+            if(j > 0)                       cv::line(dst, cv::Point(0, 0), cv::Point(0, h), heat_color(seam(i, j-1, false)), 2);
+            if(j + 1 < swpImage.div_x())    cv::line(dst, cv::Point(w, 0), cv::Point(w, h), heat_color(seam(i, j, false)), 2);
+        }
     }
 };
 
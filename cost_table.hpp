@@ -0,0 +1,195 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <chrono>
+#include <functional>
+#include <future>
+#include <limits>
+#include <memory>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "../utils/include/types.hpp"
+#include "../utils/include/exception.hpp"
+#include "grid.hpp"
+#include "trace.hpp"
+
+
+namespace procon { namespace modify {
+
+
+/** 断片に振られる0から始まる通し番号
+*/
+using TileNo = std::uint16_t;
+
+
+/** Directionを0から3の添字に変換します
+*/
+inline std::size_t direction_index(utils::Direction dir)
+{
+    switch(dir){
+      case utils::Direction::up:    return 0;
+      case utils::Direction::right: return 1;
+      case utils::Direction::down:  return 2;
+      default:                      return 3;
+    }
+}
+
+
+/** ImageIDと通し番号TileNoの対応表
+番号はImageIDのハッシュ値の順に振られるので、与える配置の並びによらず決まります。
+*/
+class TileCatalog
+{
+  public:
+    TileCatalog() = default;
+
+    explicit TileCatalog(Grid<utils::ImageID> const & index)
+    : _ids(index.begin(), index.end())
+    {
+        PROCON_ENFORCE(_ids.size() < std::numeric_limits<TileNo>::max(), "Error: too many tiles.");
+
+        std::hash<utils::ImageID> h;
+        std::stable_sort(_ids.begin(), _ids.end(), [&](utils::ImageID const & a, utils::ImageID const & b){
+            return h(a) < h(b);
+        });
+
+        for(std::size_t i = 0; i < _ids.size(); ++i)
+            _no.emplace(_ids[i], static_cast<TileNo>(i));
+    }
+
+
+    std::size_t size() const { return _ids.size(); }
+    utils::ImageID const & id(TileNo n) const { return _ids[n]; }
+    TileNo number(utils::ImageID const & id) const { return _no.at(id); }
+
+
+  private:
+    std::vector<utils::ImageID> _ids;
+    std::unordered_map<utils::ImageID, TileNo> _no;
+};
+
+
+/** 全断片の組と方向についての評価値を前もって計算しておく表
+pred(a, b, dir)と同じように呼び出せるので、predの代わりにそのまま渡せます。
+
+値は方向dirと相手の断片bごとに、aについて連続に並んでおり、
+各行の先頭はキャッシュラインに揃えられています。
+*/
+class CostTable
+{
+  public:
+    template <typename BinFunc>
+    CostTable(std::vector<std::vector<utils::ImageID>> const & index,
+              BinFunc const & pred,
+              std::size_t nThreads = std::thread::hardware_concurrency())
+    : CostTable(Grid<utils::ImageID>(index), pred, nThreads) {}
+
+
+    template <typename BinFunc>
+    CostTable(Grid<utils::ImageID> const & index,
+              BinFunc const & pred,
+              std::size_t nThreads = std::thread::hardware_concurrency())
+    : _catalog(index), _n(_catalog.size()), _stride((_n + lineSize - 1) / lineSize * lineSize),
+      _buf(4 * _n * _stride + lineSize), _data(nullptr)
+    {
+        PROCON_TRACE_SCOPE("CostTable");
+
+        const auto addr = reinterpret_cast<std::uintptr_t>(_buf.data());
+        _data = _buf.data() + (lineSize - addr / sizeof(double) % lineSize) % lineSize;
+
+        const utils::Direction dirs[4] = {utils::Direction::up, utils::Direction::right,
+                                          utils::Direction::down, utils::Direction::left};
+
+        // 4 * _n 本の行をスレッドに振り分けて埋める
+        auto fill_rows = [&](std::size_t tid, std::size_t nth){
+            for(std::size_t r = tid; r < 4 * _n; r += nth){
+                const std::size_t d = r / _n;
+                const TileNo b = r % _n;
+                double* p = _data + r * _stride;
+
+                for(std::size_t a = 0; a < _n; ++a)
+                    p[a] = (a == b) ? std::numeric_limits<double>::infinity()
+                                    : pred(_catalog.id(a), _catalog.id(b), dirs[d]);
+
+                PROCON_TRACE_COUNT("predicate calls", _n - 1);
+            }
+        };
+
+        nThreads = std::max<std::size_t>(std::min<std::size_t>(nThreads, 4 * _n), 1);
+        std::vector<std::thread> ths;
+        for(std::size_t t = 1; t < nThreads; ++t)
+            ths.emplace_back(fill_rows, t, nThreads);
+
+        fill_rows(0, nThreads);
+        for(auto& th: ths)
+            th.join();
+    }
+
+
+    CostTable(CostTable const &) = delete;
+    CostTable& operator=(CostTable const &) = delete;
+    CostTable(CostTable&&) = default;
+    CostTable& operator=(CostTable&&) = default;
+
+
+    double operator()(utils::ImageID const & a, utils::ImageID const & b, utils::Direction dir) const
+    {
+        return cost(_catalog.number(a), _catalog.number(b), direction_index(dir));
+    }
+
+
+    double cost(TileNo a, TileNo b, std::size_t dir) const { return _data[(dir * _n + b) * _stride + a]; }
+
+
+    /** 方向dir、相手の断片bについて、すべてのaの評価値が並んだ行
+    */
+    double const * row(std::size_t dir, TileNo b) const { return _data + (dir * _n + b) * _stride; }
+
+
+    TileCatalog const & catalog() const { return _catalog; }
+    std::size_t size() const { return _n; }
+
+
+  private:
+    static constexpr std::size_t lineSize = 64 / sizeof(double);
+
+    TileCatalog _catalog;
+    std::size_t _n, _stride;
+    std::vector<double> _buf;
+    double* _data;
+};
+
+
+/** CostTableを別スレッドで作り始め、最初に使うときに出来上がりを待ちます。
+makePredは評価関数を返す関数で、その別スレッドで呼ばれます。
+破棄するときは、表が出来上がるまで待ちます。
+*/
+class LazyCostTable
+{
+  public:
+    template <typename MakePred>
+    LazyCostTable(std::vector<std::vector<utils::ImageID>> const & index,
+                  MakePred makePred,
+                  std::size_t nThreads = std::thread::hardware_concurrency())
+    : _table(std::async(std::launch::async, [index, makePred, nThreads](){
+          return std::make_shared<CostTable const>(index, makePred(), nThreads);
+      }).share()) {}
+
+
+    bool ready() const { return _table.wait_for(std::chrono::seconds(0)) == std::future_status::ready; }
+
+
+    /** 出来上がった表。まだなら出来上がるまで待ちます
+    */
+    CostTable const & get() const { return *_table.get(); }
+
+
+  private:
+    std::shared_future<std::shared_ptr<CostTable const>> _table;
+};
+
+
+}}
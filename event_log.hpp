@@ -0,0 +1,184 @@
+#pragma once
+
+#include <chrono>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "../utils/include/types.hpp"
+#include "../utils/include/exception.hpp"
+
+
+namespace procon { namespace modify {
+
+
+/** 記録されたマウスイベント、キー入力、推定の開始、推定結果の反映の一つ
+*/
+struct LoggedEvent
+{
+    enum class Kind : char
+    {
+        mouse = 'm',
+        key = 'k',
+        guessStarted = 's', // 推定のキー(key)で、その時点の並びと状態からの推定が始まった
+        guess = 'g',        // 推定結果が反映された(applied)か、捨てられたか
+    };
+
+    double time;            // 記録を始めてからのミリ秒
+    Kind kind;
+    int event, x, y, flags; // kind == mouse
+    int key;                // kind == key, guessStarted
+    std::size_t revision;   // kind == guessStarted、推定を始めたときのParameter::revision
+    bool applied;           // kind == guess
+};
+
+
+/** 初期の並びを表す値
+記録と再生で同じ並びから始めているかを確かめるのに使います。
+*/
+inline std::size_t index_digest(std::vector<std::vector<utils::ImageID>> const & index)
+{
+    std::hash<utils::ImageID> h;
+    std::size_t d = index.size();
+    for(auto& r: index)
+        for(auto& e: r)
+            d = d * 1000003 ^ h(e);
+
+    return d;
+}
+
+
+/** マウスとキーの操作を、時刻つきでファイルに書き出します。
+書式は一行に一つで、
+    # modify event log 2 <初期の並びのindex_digest>
+    <ミリ秒> m <event> <x> <y> <flags>
+    <ミリ秒> k <key>
+    <ミリ秒> s <key> <revision>
+    <ミリ秒> g <0|1>
+です。異常終了しても途中までは残るよう、一行ごとにflushします。
+
+推定のキーは、推定の実行中や表の準備中には無視されたり後回しにされたりするので、
+実際に推定を始めた(か、覚えていた結果を使った)時点をsとして別に記録します。
+gは直前のsの推定の結果についてのもので、中断や失敗した推定にはgがありません。
+*/
+class EventRecorder
+{
+  public:
+    EventRecorder(std::string const & path, std::vector<std::vector<utils::ImageID>> const & index)
+    : _os(path), _start(Clock::now())
+    {
+        PROCON_ENFORCE(_os.is_open(), "Error: cannot open the event log.");
+        _os << std::fixed << std::setprecision(3);
+        _os << "# modify event log " << version << ' ' << index_digest(index) << std::endl;
+    }
+
+
+    void mouse(int event, int x, int y, int flags)
+    {
+        _os << elapsed() << " m " << event << ' ' << x << ' ' << y << ' ' << flags << std::endl;
+    }
+
+
+    void key(int key)
+    {
+        _os << elapsed() << " k " << key << std::endl;
+    }
+
+
+    void guess_started(int key, std::size_t revision)
+    {
+        _os << elapsed() << " s " << key << ' ' << revision << std::endl;
+    }
+
+
+    void guess(bool applied)
+    {
+        _os << elapsed() << " g " << (applied ? 1 : 0) << std::endl;
+    }
+
+
+    static constexpr int version = 2;
+
+
+  private:
+    using Clock = std::chrono::steady_clock;
+
+    double elapsed() const { return std::chrono::duration<double, std::milli>(Clock::now() - _start).count(); }
+
+    std::ofstream _os;
+    Clock::time_point _start;
+};
+
+
+/** EventRecorderで書き出したファイルを読み込みます
+*/
+struct EventLog
+{
+    std::size_t digest;
+    std::vector<LoggedEvent> events;
+
+
+    static EventLog read(std::string const & path)
+    {
+        std::ifstream is(path);
+        PROCON_ENFORCE(is.is_open(), "Error: cannot open the event log.");
+
+        EventLog log;
+        std::string line;
+
+        PROCON_ENFORCE(static_cast<bool>(std::getline(is, line)), "Error: the event log is empty.");
+        {
+            std::istringstream hs(line);
+            std::string sharp, modify, event, lg;
+            int version = 0;
+            hs >> sharp >> modify >> event >> lg >> version >> log.digest;
+            PROCON_ENFORCE(!hs.fail() && sharp == "#" && version == EventRecorder::version, "Error: unknown event log format.");
+        }
+
+        while(std::getline(is, line)){
+            if(line.empty())
+                continue;
+
+            std::istringstream ls(line);
+            LoggedEvent ev = {};
+            char kind = 0;
+            ls >> ev.time >> kind;
+
+            switch(kind){
+              case 'm':
+                ls >> ev.event >> ev.x >> ev.y >> ev.flags;
+                break;
+
+              case 'k':
+                ls >> ev.key;
+                break;
+
+              case 's':
+                ls >> ev.key >> ev.revision;
+                break;
+
+              case 'g': {
+                int applied = 0;
+                ls >> applied;
+                ev.applied = applied != 0;
+                break;
+              }
+
+              default:
+                PROCON_ENFORCE(false, "Error: unknown event in the event log.");
+            }
+
+            PROCON_ENFORCE(!ls.fail(), "Error: broken line in the event log.");
+            ev.kind = static_cast<LoggedEvent::Kind>(kind);
+            log.events.push_back(ev);
+        }
+
+        return log;
+    }
+};
+
+
+}}
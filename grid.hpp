@@ -0,0 +1,88 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+#include "../utils/include/types.hpp"
+
+
+namespace procon { namespace modify {
+
+
+/** 行優先で要素を一続きに持つ二次元配列
+行ごとの確保やポインタの辿りがないので、コピーも走査も一続きのメモリに対して行われます。
+(std::vector<bool>の特殊化を避けるため、Tにboolは使わないでください)
+*/
+template <typename T>
+class Grid
+{
+  public:
+    Grid() : _rows(0), _cols(0), _data() {}
+
+    Grid(std::size_t rows, std::size_t cols, T const & v = T())
+    : _rows(rows), _cols(cols), _data(rows * cols, v) {}
+
+
+    /** 入れ子のvectorから変換します
+    */
+    explicit Grid(std::vector<std::vector<T>> const & nested)
+    : _rows(nested.size()), _cols(nested.empty() ? 0 : nested[0].size()), _data()
+    {
+        _data.reserve(_rows * _cols);
+        for(auto& r: nested)
+            _data.insert(_data.end(), r.begin(), r.end());
+    }
+
+
+    /** 入れ子のvectorへ変換します
+    */
+    std::vector<std::vector<T>> to_nested() const
+    {
+        std::vector<std::vector<T>> dst;
+        dst.reserve(_rows);
+        for(std::size_t i = 0; i < _rows; ++i)
+            dst.emplace_back(_data.begin() + i * _cols, _data.begin() + (i + 1) * _cols);
+
+        return dst;
+    }
+
+
+    std::size_t rows() const { return _rows; }
+    std::size_t cols() const { return _cols; }
+    std::size_t size() const { return _data.size(); }
+    bool empty() const { return _data.empty(); }
+
+    T& operator()(std::size_t i, std::size_t j) { return _data[i * _cols + j]; }
+    T const & operator()(std::size_t i, std::size_t j) const { return _data[i * _cols + j]; }
+
+    T& operator[](utils::Index2D const & idx) { return (*this)(idx[0], idx[1]); }
+    T const & operator[](utils::Index2D const & idx) const { return (*this)(idx[0], idx[1]); }
+
+    // 行優先の通し番号でのアクセス
+    T& operator[](std::size_t k) { return _data[k]; }
+    T const & operator[](std::size_t k) const { return _data[k]; }
+
+    T* data() { return _data.data(); }
+    T const * data() const { return _data.data(); }
+
+    typename std::vector<T>::iterator begin() { return _data.begin(); }
+    typename std::vector<T>::iterator end() { return _data.end(); }
+    typename std::vector<T>::const_iterator begin() const { return _data.begin(); }
+    typename std::vector<T>::const_iterator end() const { return _data.end(); }
+
+
+    bool operator==(Grid const & rhs) const
+    {
+        return _rows == rhs._rows && _cols == rhs._cols && _data == rhs._data;
+    }
+
+    bool operator!=(Grid const & rhs) const { return !(*this == rhs); }
+
+
+  private:
+    std::size_t _rows, _cols;
+    std::vector<T> _data;
+};
+
+
+}}
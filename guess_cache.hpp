@@ -0,0 +1,128 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <list>
+#include <utility>
+#include <boost/optional.hpp>
+
+#include "../utils/include/types.hpp"
+#include "common.hpp"
+#include "cost_table.hpp"
+#include "grid.hpp"
+#include "interactive_guess.hpp"
+
+
+namespace procon { namespace modify {
+
+
+/** 推定の入力。同じ入力からは同じ推定結果が得られます
+*/
+struct GuessKey
+{
+    ImgMap index;
+    Grid<TileState> states;
+    CostTable const * table;    // 評価関数。表はmodify_guess_imageの間ずっと生きているので、アドレスで区別する
+    SearchMode mode;
+
+
+    std::size_t hash() const
+    {
+        std::hash<utils::ImageID> h;
+        std::size_t d = reinterpret_cast<std::size_t>(table) ^ static_cast<std::size_t>(mode);
+        for(std::size_t k = 0; k < index.size(); ++k){
+            auto& s = states[k];
+            const std::size_t st = s.isFree() ? 0 : (s.isFixed() ? 1 : s.groupId() + 2);
+            d = (d * 1000003 ^ h(index[k])) * 1000003 ^ st;
+        }
+
+        return d;
+    }
+
+
+    bool operator==(GuessKey const & rhs) const
+    {
+        return table == rhs.table && mode == rhs.mode && index == rhs.index && states == rhs.states;
+    }
+};
+
+
+/** 推定結果を、新しく使われた順にcapacity個まで覚えておきます。
+同じ状態でspaceを押し直したときや、zで戻してから推定し直したときに、探索せずに結果を返すためのものです。
+modify_guess_imageのメインループからだけ使うので、ロックは取りません。
+*/
+class GuessCache
+{
+  public:
+    explicit GuessCache(std::size_t capacity)
+    : _capacity(capacity), _entries(), _lookups(0), _hits(0) {}
+
+
+    boost::optional<ImgMap> find(GuessKey const & key)
+    {
+        ++_lookups;
+
+        auto it = lookup(key.hash(), key);
+        if(it == _entries.end())
+            return boost::none;
+
+        ++_hits;
+        _entries.splice(_entries.begin(), _entries, it);
+        return _entries.front().result;
+    }
+
+
+    bool contains(GuessKey const & key) const
+    {
+        const std::size_t h = key.hash();
+        for(auto& e: _entries)
+            if(e.hash == h && e.key == key)
+                return true;
+
+        return false;
+    }
+
+
+    void store(GuessKey key, ImgMap result)
+    {
+        const std::size_t h = key.hash();
+        auto it = lookup(h, key);
+        if(it != _entries.end())
+            _entries.erase(it);
+
+        _entries.push_front(Entry{h, std::move(key), std::move(result)});
+        if(_entries.size() > _capacity)
+            _entries.pop_back();
+    }
+
+
+    std::size_t lookups() const { return _lookups; }
+    std::size_t hits() const { return _hits; }
+
+
+  private:
+    struct Entry
+    {
+        std::size_t hash;
+        GuessKey key;
+        ImgMap result;
+    };
+
+
+    std::list<Entry>::iterator lookup(std::size_t h, GuessKey const & key)
+    {
+        for(auto it = _entries.begin(); it != _entries.end(); ++it)
+            if(it->hash == h && it->key == key)
+                return it;
+
+        return _entries.end();
+    }
+
+
+    std::size_t _capacity;
+    std::list<Entry> _entries;
+    std::size_t _lookups, _hits;
+};
+
+
+}}
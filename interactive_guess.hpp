@@ -1,13 +1,23 @@
 #pragma once
 
 #include <algorithm>
+#include <array>
+#include <cstdint>
 #include <set>
 #include <memory>
 #include <vector>
 #include <unordered_map>
-#include <unordered_set>
 #include <boost/optional.hpp>
 #include <boost/range/adaptors.hpp>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
 
 #include "../utils/include/types.hpp"
 #include "../utils/include/image.hpp"
@@ -15,153 +25,303 @@
 #include "../utils/include/exception.hpp"
 #include "../utils/include/dwrite.hpp"
 #include "common.hpp"
+#include "bitboard.hpp"
+#include "cost_table.hpp"
+#include "grid.hpp"
+#include "thread_pool.hpp"
+#include "trace.hpp"
+#include "transposition.hpp"
 
 namespace procon { namespace modify {
 
 using namespace utils;
 
-using Group = std::vector<std::tuple<ImageID, std::array<std::ptrdiff_t, 2>>>;
-using OptionalMap = std::vector<std::vector<boost::optional<ImageID>>>;
-using ImgMap = std::vector<std::vector<ImageID>>;
-using Remains = std::unordered_set<ImageID>;
+/** 探索の内側では、断片をCostTableの通し番号TileNoで扱います。
+ImageIDとの変換はinteractive_guessの入口と出口でだけ行います。
+*/
+constexpr TileNo noTile = std::numeric_limits<TileNo>::max();
+
+using ImgMap = Grid<ImageID>;
+using OptionalMap = Grid<TileNo>;       // noTileのマスは空き
+using TileMap = Grid<TileNo>;
+using Group = std::vector<std::tuple<TileNo, std::array<std::ptrdiff_t, 2>>>;
+using Remains = std::vector<TileNo>;
 
 
 template <typename BinFunc>
 double calcAllValue(ImgMap const & imgMap, BinFunc const & pred)
 {
-    const auto div_y = imgMap.size(),
-               div_x = imgMap[0].size();
+    const auto div_y = imgMap.rows(),
+               div_x = imgMap.cols();
 
     double sumV = 0;
     for (auto i : iota(1, div_y))
         for (auto j : iota(0, div_x)){
-            const auto imgID1 = imgMap[i-1][j],
-                       imgID2 = imgMap[i][j];
+            const auto imgID1 = imgMap(i-1, j),
+                       imgID2 = imgMap(i, j);
 
             sumV += pred(imgID1, imgID2, Direction::down);
         }
 
     for (auto i : iota(0, div_y))
         for (auto j : iota(1, div_x)){
-            const auto imgID1 = imgMap[i][j - 1],
-                       imgID2 = imgMap[i][j];
+            const auto imgID1 = imgMap(i, j - 1),
+                       imgID2 = imgMap(i, j);
         
             sumV += pred(imgID1, imgID2, Direction::right);
         }
 
+    PROCON_TRACE_COUNT("predicate calls", (div_y - 1) * div_x + div_y * (div_x - 1));
     return sumV;
 }
 
 
-template <typename BinFunc>
-ImgMap fill_remain_tile(
-        OptionalMap const & imgMap,
-        Remains const & remain,
-        BinFunc const & pred)
+/** 通し番号の配置についてのcalcAllValueです。
+足し合わせる順番はImageID版と同じなので、同じ値になります。
+*/
+double calcAllValue(TileMap const & map, CostTable const & table)
 {
-    const auto div_y = imgMap.size(),
-               div_x = imgMap[0].size();
+    const auto div_y = map.rows(),
+               div_x = map.cols();
+    const auto down = direction_index(Direction::down),
+               right = direction_index(Direction::right);
 
-    OptionalMap before = imgMap;
+    double sumV = 0;
+    for (std::size_t i = 1; i < div_y; ++i)
+        for (std::size_t j = 0; j < div_x; ++j)
+            sumV += table.cost(map(i-1, j), map(i, j), down);
 
-    PROCON_ENFORCE(before.size() == div_y, "Contract error: 'before.size() != div_y'");
+    for (std::size_t i = 0; i < div_y; ++i)
+        for (std::size_t j = 1; j < div_x; ++j)
+            sumV += table.cost(map(i, j-1), map(i, j), right);
 
-    for(auto i: iota(div_y))
-        PROCON_ENFORCE(before[i].size() == div_x, format("Contract error: 'before[%].size() != div_x'", i));
+    return sumV;
+}
 
-    // beforeでの抜け落ち`where`の周囲について、`which`画像がどの程度マッチするかを返す
-    auto around_pred_value = [&](Index2D where, ImageID which){
-        const auto i = where[0],
-                   j = where[1];
 
-        auto pred_value = [&](ImageID a, ImageID b, Direction dir)
-        { return std::abs(pred(a, b, dir)); };
+/** 通し番号の配置をImageIDの配置に戻します
+*/
+ImgMap to_img_map(TileMap const & map, TileCatalog const & catalog)
+{
+    ImgMap dst(map.rows(), map.cols());
+    for(std::size_t k = 0; k < map.size(); ++k){
+        PROCON_ENFORCE(map[k] != noTile, "Error: all before's elements are null.");
+        dst[k] = catalog.id(map[k]);
+    }
 
-        double v = 0;
-        if(i > 0 && !!before[i-1][j])           v += pred_value(which, *before[i-1][j], Direction::up);
-        if(i < div_y - 1 && !!before[i+1][j])   v += pred_value(which, *before[i+1][j], Direction::down); 
-        if(j > 0 && !!before[i][j-1])           v += pred_value(which, *before[i][j-1], Direction::left);
-        if(j < div_x - 1 && !!before[i][j+1])   v += pred_value(which, *before[i][j+1], Direction::right);
+    return dst;
+}
 
-        // writefln("%, %, %", where, which, v);
-        return v;
-    };
 
+/** fill_remain_tileで次に埋める空きマスを管理します。
+空きマスを埋まっている隣接マスの数ごとにビット集合で分類しておき、
+数が最大(ただし1以上)のもののうち行優先で最初のマスを返します。
+マスを埋めたときは、その周囲の空きマスだけを更新します。
+*/
+class FillFrontier
+{
+  public:
+    explicit FillFrontier(OptionalMap const & map)
+    : _div_y(map.rows()), _div_x(map.cols()),
+      _nWords((_div_y * _div_x + 63) / 64),
+      _filled(_div_y * _div_x, false),
+      _count(_div_y * _div_x, 0),
+      _bucket()
+    {
+        for(auto& b: _bucket)
+            b.assign(_nWords, 0);
+
+        for(std::size_t c = 0; c < map.size(); ++c)
+            _filled[c] = map[c] != noTile;
 
-    // 次のbeforeでの抜け落ち位置を返す
-    auto get_nextTargetIndex = [&](){
-        auto targetIndex = boost::optional<Index2D>(boost::none);
-        std::size_t maxN = 0;
-        for(auto i: iota(div_y))
-            for(auto j: iota(div_x)){
-                if(before[i][j])
-                    continue;
+        for(std::size_t i = 0; i < _div_y; ++i)
+            for(std::size_t j = 0; j < _div_x; ++j){
+                const std::size_t c = i * _div_x + j;
+                if(_filled[c]) continue;
 
-                std::size_t cnt = 0;
-                if(i > 0 && !!before[i-1][j])           ++cnt;
-                if(i < div_y - 1 && !!before[i+1][j])   ++cnt;
-                if(j > 0 && !!before[i][j-1])           ++cnt;
-                if(j < div_x - 1 && !!before[i][j+1])   ++cnt;
+                foreach_neighbor(i, j, [&](std::size_t n){ if(_filled[n]) ++_count[c]; });
+                insert(_count[c], c);
+            }
+    }
 
-                if(maxN < cnt){
-                    maxN = cnt;
-                    targetIndex = makeIndex2D(i, j);
 
-                    if(cnt == 4) goto Lreturn;
+    boost::optional<Index2D> next() const
+    {
+        for(std::size_t k = 4; k > 0; --k)
+            for(std::size_t w = 0; w < _nWords; ++w)
+                if(_bucket[k][w]){
+                    const std::size_t c = w * 64 + lowest_bit(_bucket[k][w]);
+                    return makeIndex2D(c / _div_x, c % _div_x);
                 }
-            }
-      Lreturn:
-        return targetIndex;
+
+        return boost::none;
+    }
+
+
+    void fill(std::size_t i, std::size_t j)
+    {
+        const std::size_t c = i * _div_x + j;
+        erase(_count[c], c);
+        _filled[c] = true;
+
+        foreach_neighbor(i, j, [&](std::size_t n){
+            if(_filled[n]) return;
+
+            erase(_count[n], n);
+            insert(++_count[n], n);
+        });
+    }
+
+
+  private:
+    template <typename F>
+    void foreach_neighbor(std::size_t i, std::size_t j, F f) const
+    {
+        if(i > 0)           f((i - 1) * _div_x + j);
+        if(i < _div_y - 1)  f((i + 1) * _div_x + j);
+        if(j > 0)           f(i * _div_x + j - 1);
+        if(j < _div_x - 1)  f(i * _div_x + j + 1);
+    }
+
+
+    void insert(std::size_t k, std::size_t c) { _bucket[k][c / 64] |= (std::uint64_t(1) << (c % 64)); }
+    void erase(std::size_t k, std::size_t c) { _bucket[k][c / 64] &= ~(std::uint64_t(1) << (c % 64)); }
+
+
+    std::size_t _div_y, _div_x, _nWords;
+    std::vector<bool> _filled;
+    std::vector<std::uint8_t> _count;
+    std::array<std::vector<std::uint64_t>, 5> _bucket;     // _bucket[k] : 埋まっている隣接マスがk個の空きマス
+};
+
+
+/** fill_remain_tileで、まだ置かれていない断片の集合
+断片は連続した配列に持ち、取り除くときは末尾の断片と入れ替えます。
+*/
+struct Candidates
+{
+    explicit Candidates(Remains const & remain)
+    : ids(remain), score(remain.size()) {}
+
+
+    std::vector<TileNo> ids;
+    std::vector<double> score;
+
+
+    std::size_t size() const { return ids.size(); }
+
+
+    void remove(std::size_t k)
+    {
+        ids[k] = ids.back();
+        ids.pop_back();
+    }
+
+
+    /** scoreが最小の断片の添字を返します。
+    同点の場合は、通し番号(ImageIDのハッシュ値の順)が小さいものを選ぶので、
+    Remainsの並びによらず結果が決まります。
+    */
+    std::size_t argmin() const
+    {
+        const std::size_t n = size();
+        double const * sc = score.data();
+
+        double m = std::numeric_limits<double>::infinity();
+        for(std::size_t k = 0; k < n; ++k)
+            m = sc[k] < m ? sc[k] : m;
+
+        std::size_t best = n;
+        for(std::size_t k = 0; k < n; ++k)
+            if(sc[k] == m && (best == n || ids[k] < ids[best]))
+                best = k;
+
+        return best;
+    }
+};
+
+
+/** mapの抜け落ち`where`の周囲について、各候補がどの程度マッチするかをc.scoreに書き込みます。
+隣接する断片ごとの行(最大4本)を、候補について足し合わせます。
+*/
+void score_candidates(Candidates& c, OptionalMap const & map, Index2D where, CostTable const & table)
+{
+    const auto i = where[0],
+               j = where[1],
+               div_y = map.rows(),
+               div_x = map.cols();
+
+    double const * rows[4];
+    std::size_t nRows = 0;
+    auto add_row = [&](TileNo nb, Direction dir){
+        if(nb != noTile) rows[nRows++] = table.row(direction_index(dir), nb);
     };
 
+    if(i > 0)           add_row(map(i-1, j), Direction::up);
+    if(i < div_y - 1)   add_row(map(i+1, j), Direction::down);
+    if(j > 0)           add_row(map(i, j-1), Direction::left);
+    if(j < div_x - 1)   add_row(map(i, j+1), Direction::right);
+
+    const std::size_t n = c.size();
+    double* sc = c.score.data();
+    TileNo const * no = c.ids.data();
+
+    std::fill(sc, sc + n, 0.0);
+    for(std::size_t r = 0; r < nRows; ++r){
+        double const * row = rows[r];
+        for(std::size_t k = 0; k < n; ++k)
+            sc[k] += std::abs(row[no[k]]);
+    }
+}
+
+
+TileMap fill_remain_tile(
+        OptionalMap const & imgMap,
+        Remains const & remain,
+        CostTable const & table)
+{
+    PROCON_TRACE_COUNT("fills", 1);
+
+    OptionalMap before = imgMap;
+    FillFrontier frontier(before);
 
-    Remains rem = remain;
+    Candidates rem(remain);
     while(1){
-        auto tgtIdx = get_nextTargetIndex();
+        auto tgtIdx = frontier.next();
         if (!tgtIdx)
             break;
 
-        PROCON_ENFORCE(!before[(*tgtIdx)[0]][(*tgtIdx)[1]], "Error");
+        PROCON_ENFORCE(before[*tgtIdx] == noTile, "Error");
 
         // writeln(*tgtIdx);
-        PROCON_ENFORCE(!rem.empty(), "Error, rem.empty() == true");
-
-        double min = std::numeric_limits<double>::infinity();
-        boost::optional<ImageID> mostImg = boost::none;
-        for(auto& imgId: rem){
-            const double v = around_pred_value(*tgtIdx, imgId);
-            if(v <= min){
-                min = v;
-                mostImg = imgId;
-            }
-        }
+        PROCON_ENFORCE(rem.size() != 0, "Error, rem.empty() == true");
+
+        score_candidates(rem, before, *tgtIdx, table);
+        const std::size_t most = rem.argmin();
 
         // writeln(*mostIndex);
-        PROCON_ENFORCE(mostImg, "Error, mostImg is null");
-        before[(*tgtIdx)[0]][(*tgtIdx)[1]] = *mostImg;
-        rem.erase(*mostImg);
+        PROCON_ENFORCE(most != rem.size(), "Error, mostImg is null");
+        before[*tgtIdx] = rem.ids[most];
+        rem.remove(most);
+        frontier.fill((*tgtIdx)[0], (*tgtIdx)[1]);
     }
 
-    ImgMap dst; dst.reserve(before.size());
-    for(auto i: iota(before.size())){
-        dst.emplace_back(before[i].size());
-        for(auto j: iota(before[i].size()))
-            dst[i][j] = *PROCON_ENFORCE(before[i][j], "Error: all before's elements are null.");
-    }
+    for(auto& e: before)
+        PROCON_ENFORCE(e != noTile, "Error: all before's elements are null.");
 
-    // writeln(dst);
-    return dst;
+    // writeln(before);
+    return before;
 }
 
 
 bool is_fit(Group const & group, OptionalMap const & imgMap, std::size_t i, std::size_t j)
 {
-    if(i >= imgMap.size() || j >= imgMap[i].size())
+    if(i >= imgMap.rows() || j >= imgMap.cols())
         return false;
 
     auto can_put = [&](std::ptrdiff_t i, std::ptrdiff_t j) -> bool {
-        if(opCmp<ptrdiff_t>(i, imgMap.size()) >= 0 || opCmp<ptrdiff_t>(j, imgMap[i].size()) >= 0 || i < 0 || j < 0) return false;
-        return !imgMap[i][j];
+        if(opCmp<ptrdiff_t>(i, imgMap.rows()) >= 0 || opCmp<ptrdiff_t>(j, imgMap.cols()) >= 0 || i < 0 || j < 0) return false;
+        return imgMap(i, j) == noTile;
     };
 
     for(auto& e: group)
@@ -172,84 +332,867 @@ bool is_fit(Group const & group, OptionalMap const & imgMap, std::size_t i, std:
 }
 
 
-void set_opt_map(Group const & g, OptionalMap& imgMap, size_t i, size_t j)
+/** 探索中の地図と、その空いているマスの集合
+freeはset_opt_mapとreset_opt_mapで地図と一緒に更新します。盤面が256マスを超えるときは使いません。
+*/
+struct SearchMap
+{
+    explicit SearchMap(OptionalMap const & m)
+    : map(m), free(m.size() <= Bitboard::capacity ? free_cells(m, noTile) : Bitboard()) {}
+
+
+    OptionalMap map;
+    Bitboard free;
+};
+
+
+void set_opt_map(Group const & g, SearchMap& m, size_t i, size_t j)
+{
+    const bool useFree = m.map.size() <= Bitboard::capacity;
+    for (auto& e : g){
+        const size_t r = i + std::get<1>(e)[0],
+                     c = j + std::get<1>(e)[1];
+
+        m.map(r, c) = std::get<0>(e);
+        if(useFree) m.free.reset(r * m.map.cols() + c);
+    }
+}
+
+void reset_opt_map(Group const & g, SearchMap& m, size_t i, size_t j)
+{
+    const bool useFree = m.map.size() <= Bitboard::capacity;
+    for (auto& e : g){
+        const size_t r = i + std::get<1>(e)[0],
+                     c = j + std::get<1>(e)[1];
+
+        m.map(r, c) = noTile;
+        if(useFree) m.free.set(r * m.map.cols() + c);
+    }
+}
+
+
+/** [bg, ed)の各グループを、盤面に合わせて前もってGroupMaskにしたもの。
+探索の始めに一度だけ作ります。盤面が256マスを超えるときは空です。
+*/
+template <typename Iter>
+std::vector<GroupMask> make_group_masks(Iter bg, Iter ed, OptionalMap const & imgMap)
+{
+    std::vector<GroupMask> dst;
+    if(imgMap.size() <= Bitboard::capacity)
+        for(; bg != ed; ++bg)
+            dst.emplace_back(*bg, imgMap.rows(), imgMap.cols());
+
+    return dst;
+}
+
+
+/** gを置けるアンカー(i, j)を、行優先の順にfに渡します。
+maskがあればm.freeとのビット演算で置ける位置をまとめて求め、なければ(盤面が256マスを超えれば)is_fitで一つずつ調べます。
+fの中でmを書き換える場合は、fから戻る前に呼び出し前の状態に戻してください。
+*/
+template <typename F>
+void foreach_fit_anchor(Group const & g, GroupMask const * mask, SearchMap const & m, F f)
+{
+    const std::size_t cols = m.map.cols();
+
+    if(mask){
+        mask->fit_anchors(m.free).foreach([&](std::size_t k){
+            f(k / cols, k % cols);
+        });
+        return;
+    }
+
+    for(std::size_t i = 0; i < m.map.rows(); ++i)
+        for(std::size_t j = 0; j < cols; ++j)
+            if(is_fit(g, m.map, i, j))
+                f(i, j);
+}
+
+
+/** 推定を途中で打ち切ったときに投げられる例外
+*/
+struct GuessCancelled : std::runtime_error
+{
+    GuessCancelled() : std::runtime_error("guess was cancelled") {}
+};
+
+
+/** 推定の進み具合
+探索を行うスレッドが書き込み、UIスレッドが読み出します。
+cancelが呼ばれると、探索は次の節点に入ったところでGuessCancelledを投げて止まります。
+*/
+class GuessProgress
 {
-    for (auto& e : g)
-        imgMap[i + std::get<1>(e)[0]][j + std::get<1>(e)[1]] = std::get<0>(e);
+  public:
+    GuessProgress() : _explored(0), _best(std::numeric_limits<double>::infinity()), _cancel(false) {}
+
+
+    std::size_t explored() const { return _explored.load(std::memory_order_relaxed); }   // 評価し終えた配置の数
+    double best() const { return _best.load(std::memory_order_relaxed); }               // これまでで最良の評価値
+
+    void cancel() { _cancel = true; }
+    bool cancelled() const { return _cancel.load(std::memory_order_relaxed); }
+
+
+    void check() const
+    {
+        if(cancelled())
+            throw GuessCancelled();
+    }
+
+
+    void report(double v)
+    {
+        _explored.fetch_add(1, std::memory_order_relaxed);
+
+        double cur = _best.load(std::memory_order_relaxed);
+        while(v < cur && !_best.compare_exchange_weak(cur, v, std::memory_order_relaxed)) {}
+    }
+
+
+  private:
+    std::atomic<std::size_t> _explored;
+    std::atomic<double> _best;
+    std::atomic<bool> _cancel;
+};
+
+
+/** 全てのグループを置いた地図の残りを埋め、その評価値と配置を返します。
+ttがあれば、同じ地図と残りの組について前に計算した結果を使います。
+*/
+std::tuple<double, TileMap> evaluate_leaf(OptionalMap const & imgMap, Remains const & remain, CostTable const & pred, TranspositionTable* tt)
+{
+    std::uint64_t h = 0;
+    if(tt){
+        h = TranspositionTable::hash(imgMap, remain, noTile);
+
+        auto dst = std::make_tuple(0.0, TileMap());
+        if(tt->find(h, imgMap, std::get<0>(dst), std::get<1>(dst)))
+            return dst;
+    }
+
+    auto idxArr = fill_remain_tile(imgMap, remain, pred);
+    const double val = calcAllValue(idxArr, pred);
+    if(tt) tt->store(h, imgMap, val, idxArr);
+
+    return std::make_tuple(val, std::move(idxArr));
 }
 
-void reset_opt_map(Group const & g, OptionalMap& imgMap, size_t i, size_t j)
+
+/** グループ*bgから順に置ける位置をすべて試し、最も評価値の良い配置を返します。
+maskは*bgのGroupMaskで、以降のグループのものが続いて並んでいます(make_group_masks)。なければnullptrです。
+mは置いている間だけ書き換え、戻るときには元の状態に戻します。
+*/
+template <typename Iter>
+std::tuple<double, TileMap>
+    position_bfs(Iter bg, Iter ed,
+                 SearchMap& m,
+                 GroupMask const * mask,
+                 Remains const & remain,
+                 Problem const & pb,
+                 CostTable const & pred,
+                 GuessProgress* progress,
+                 TranspositionTable* tt)
 {
-    for (auto& e : g)
-        imgMap[i + std::get<1>(e)[0]][j + std::get<1>(e)[1]] = boost::none;
+    PROCON_TRACE_COUNT("nodes", 1);
+    if(progress) progress->check();
+
+    if (bg == ed){
+        auto dst = evaluate_leaf(m.map, remain, pred, tt);
+        if(progress) progress->report(std::get<0>(dst));
+
+        return dst;
+    }
+
+    Group const & g = *bg;
+    Iter next = bg + 1;
+    GroupMask const * nextMask = mask ? mask + 1 : nullptr;
+
+    auto dst = std::make_tuple(std::numeric_limits<double>::infinity(), TileMap());
+    foreach_fit_anchor(g, mask, m, [&](size_t i, size_t j){
+        set_opt_map(g, m, i, j);
+        auto res = position_bfs(next, ed, m, nextMask, remain, pb, pred, progress, tt);
+        reset_opt_map(g, m, i, j);
+
+        if(std::get<0>(res) <= std::get<0>(dst))
+            dst = std::move(res);
+    });
+
+    return dst;
 }
 
 
-template <typename Iter, typename BinFunc>
-std::tuple<double, ImgMap>
+template <typename Iter>
+std::tuple<double, TileMap>
     position_bfs(Iter bg, Iter ed,
                  OptionalMap const & imgMap,
                  Remains const & remain,
                  Problem const & pb,
-                 BinFunc const & pred)
+                 CostTable const & pred,
+                 GuessProgress* progress = nullptr,
+                 TranspositionTable* tt = nullptr)
+{
+    const auto masks = make_group_masks(bg, ed, imgMap);
+    SearchMap m(imgMap);
+
+    return position_bfs(bg, ed, m, masks.empty() ? nullptr : masks.data(), remain, pb, pred, progress, tt);
+}
+
+
+/** 探索方法
+*/
+enum class SearchMode
+{
+    exhaustive,         // すべての配置について評価する
+    branchAndBound,     // 下界が暫定解を超える配置を枝刈りする
+    beam,               // 下界の小さい配置だけを残して進む。時間内に見つかった最良のものを返す
+};
+
+
+/** 配置途中のOptionalMapから、完成した配置のcalcAllValueの下界を求めます。
+両側が決まっている継ぎ目は実際の値、片側だけ決まっている継ぎ目はその断片についての最小値、
+どちらも決まっていない継ぎ目は全断片の組についての最小値で見積もります。
+*/
+class PlacementBound
+{
+  public:
+    PlacementBound(std::vector<TileNo> const & ids, CostTable const & table)
+    : _table(table),
+      _minDown(std::numeric_limits<double>::infinity()),
+      _minRight(std::numeric_limits<double>::infinity()),
+      _tileMin(table.size(), std::array<double, 4>({std::numeric_limits<double>::infinity(),
+                                                    std::numeric_limits<double>::infinity(),
+                                                    std::numeric_limits<double>::infinity(),
+                                                    std::numeric_limits<double>::infinity()}))
+    {
+        const auto down = direction_index(Direction::down),
+                   right = direction_index(Direction::right);
+
+        for(auto a: ids){
+            auto& ma = _tileMin[a];
+            for(auto b: ids){
+                if(a == b) continue;
+
+                auto& mb = _tileMin[b];
+                const double d = table.cost(a, b, down),
+                             r = table.cost(a, b, right);
+
+                ma[0] = std::min(ma[0], d);     // aが上
+                mb[1] = std::min(mb[1], d);     // bが下
+                ma[2] = std::min(ma[2], r);     // aが左
+                mb[3] = std::min(mb[3], r);     // bが右
+                _minDown = std::min(_minDown, d);
+                _minRight = std::min(_minRight, r);
+            }
+        }
+    }
+
+
+    double operator()(OptionalMap const & map) const
+    {
+        const auto div_y = map.rows(),
+                   div_x = map.cols();
+
+        double v = 0;
+        for(std::size_t i = 1; i < div_y; ++i)
+            for(std::size_t j = 0; j < div_x; ++j)
+                v += seam(map(i-1, j), map(i, j), Direction::down, 0, 1, _minDown);
+
+        for(std::size_t i = 0; i < div_y; ++i)
+            for(std::size_t j = 1; j < div_x; ++j)
+                v += seam(map(i, j-1), map(i, j), Direction::right, 2, 3, _minRight);
+
+        return v;
+    }
+
+
+  private:
+    double seam(TileNo a, TileNo b, Direction dir, std::size_t ia, std::size_t ib, double minAll) const
+    {
+        if(a != noTile && b != noTile)  return _table.cost(a, b, direction_index(dir));
+        else if(a != noTile)            return _tileMin[a][ia];
+        else if(b != noTile)            return _tileMin[b][ib];
+        else                            return minAll;
+    }
+
+
+    CostTable const & _table;
+    double _minDown, _minRight;
+    std::vector<std::array<double, 4>> _tileMin;
+};
+
+
+/** スレッド間で共有する暫定解の評価値
+*/
+class Incumbent
+{
+  public:
+    Incumbent() : _v(std::numeric_limits<double>::infinity()) {}
+
+
+    double value() const { return _v.load(); }
+
+
+    void update(double v)
+    {
+        double cur = _v.load();
+        while(v < cur && !_v.compare_exchange_weak(cur, v)) {}
+    }
+
+
+    /** 下界がboundの部分木を探索しなくてよいかどうか。
+    評価値が等しい配置の選び方を変えないよう、丸め誤差の分だけ余裕を持たせます。
+    */
+    bool prunes(double bound) const
+    {
+        const double b = value();
+        return bound > b + 1e-9 * (std::abs(b) + 1);
+    }
+
+
+  private:
+    std::atomic<double> _v;
+};
+
+
+/** position_bfsに分枝限定法による枝刈りを加えたものです。
+枝刈りされるのは暫定解より真に悪い部分木だけなので、position_bfsと同じ結果を返します。
+*/
+template <typename Iter>
+std::tuple<double, TileMap>
+    position_bnb(Iter bg, Iter ed,
+                 SearchMap& m,
+                 GroupMask const * mask,
+                 Remains const & remain,
+                 Problem const & pb,
+                 CostTable const & pred,
+                 PlacementBound const & bound,
+                 Incumbent & incumbent,
+                 GuessProgress* progress,
+                 TranspositionTable* tt)
 {
-    OptionalMap copyedMap = imgMap;
+    PROCON_TRACE_COUNT("nodes", 1);
+    if(progress) progress->check();
+
+    if(incumbent.prunes(bound(m.map)))
+        return std::make_tuple(std::numeric_limits<double>::infinity(), TileMap());
 
     if (bg == ed){
-        auto idxArr = fill_remain_tile(copyedMap, remain, pred);
-        double val = calcAllValue(idxArr, pred);
+        auto dst = evaluate_leaf(m.map, remain, pred, tt);
+        incumbent.update(std::get<0>(dst));
+        if(progress) progress->report(std::get<0>(dst));
 
-        return std::make_tuple(val, idxArr);
+        return dst;
     }
 
-    Group& g = *bg;
+    Group const & g = *bg;
     Iter next = bg + 1;
+    GroupMask const * nextMask = mask ? mask + 1 : nullptr;
 
-    auto dst = std::make_tuple(std::numeric_limits<double>::infinity(), ImgMap());
-    DividedImage::foreach(pb, [&](size_t i, size_t j){
-        if(is_fit(g, copyedMap, i, j)){
-            set_opt_map(g, copyedMap, i, j);
-            auto res = position_bfs(next, ed, copyedMap, remain, pb, pred);
-            reset_opt_map(g, copyedMap, i, j);
+    auto dst = std::make_tuple(std::numeric_limits<double>::infinity(), TileMap());
+    foreach_fit_anchor(g, mask, m, [&](size_t i, size_t j){
+        set_opt_map(g, m, i, j);
+        auto res = position_bnb(next, ed, m, nextMask, remain, pb, pred, bound, incumbent, progress, tt);
+        reset_opt_map(g, m, i, j);
 
-            if(std::get<0>(res) <= std::get<0>(dst))
-                dst = std::move(res);
-        }
+        if(std::get<0>(res) <= std::get<0>(dst))
+            dst = std::move(res);
     });
 
     return dst;
 }
 
 
-template <typename BinFunc>
-ImgMap interactive_guess(Parameter const & param, Problem const & pb, BinFunc const & pred)
+template <typename Iter>
+std::tuple<double, TileMap>
+    position_bnb(Iter bg, Iter ed,
+                 OptionalMap const & imgMap,
+                 Remains const & remain,
+                 Problem const & pb,
+                 CostTable const & pred,
+                 PlacementBound const & bound,
+                 Incumbent & incumbent,
+                 GuessProgress* progress = nullptr,
+                 TranspositionTable* tt = nullptr)
 {
-    using namespace boost::adaptors;
+    const auto masks = make_group_masks(bg, ed, imgMap);
+    SearchMap m(imgMap);
 
-    auto& imgIdx = param.swpImage.get_index();
-    auto gps = [&](){
-        std::vector<Group> gps;
-        DividedImage::foreach(param.swpImage, [&](size_t i, size_t j){
-            if(param.tileState[i][j].isGrouped()){
-                const auto gId = param.tileState[i][j].groupId();
-                if(gps.size() <= gId)
-                    gps.resize(gId + 1);
-
-                gps[gId].emplace_back(imgIdx[i][j],
-                    std::array<std::ptrdiff_t, 2>({static_cast<std::ptrdiff_t>(i),
-                                                   static_cast<std::ptrdiff_t>(j)}));
+    return position_bnb(bg, ed, m, masks.empty() ? nullptr : masks.data(), remain, pb, pred, bound, incumbent, progress, tt);
+}
+
+
+/** 配置の探索で使われるすべての断片
+*/
+template <typename Iter>
+std::vector<TileNo> collect_ids(Iter bg, Iter ed, OptionalMap const & imgMap, Remains const & remain)
+{
+    std::vector<TileNo> ids(remain.begin(), remain.end());
+    for(auto e: imgMap)
+        if(e != noTile) ids.push_back(e);
+
+    for(; bg != ed; ++bg)
+        for(auto& e: *bg)
+            ids.push_back(std::get<0>(e));
+
+    return ids;
+}
+
+
+/** position_bfs(またはposition_bnb)を複数スレッドで行います。
+配置の木の上の方を仕事に分割し、ワークスティーリングでnThreads個のスレッドに分配します。
+評価値が同じ配置が複数ある場合も、position_bfsと同じもの(アンカーの列が辞書順で最後のもの)を返します。
+*/
+template <typename Iter>
+std::tuple<double, TileMap>
+    position_bfs_parallel(Iter bg, Iter ed,
+                          OptionalMap const & imgMap,
+                          Remains const & remain,
+                          Problem const & pb,
+                          CostTable const & pred,
+                          std::size_t nThreads,
+                          SearchMode mode = SearchMode::exhaustive,
+                          GuessProgress* progress = nullptr,
+                          TranspositionTable* tt = nullptr)
+{
+    PROCON_TRACE_SCOPE("position_bfs_parallel");
+
+    if(mode == SearchMode::exhaustive && (nThreads <= 1 || bg == ed))
+        return position_bfs(bg, ed, imgMap, remain, pb, pred, progress, tt);
+
+    boost::optional<PlacementBound> bound;
+    Incumbent incumbent;
+    if(mode == SearchMode::branchAndBound){
+        bound.emplace(collect_ids(bg, ed, imgMap, remain), pred);
+
+        if(nThreads <= 1 || bg == ed)
+            return position_bnb(bg, ed, imgMap, remain, pb, pred, *bound, incumbent, progress, tt);
+    }
+
+    // グループの形は一度だけ変換して、すべての仕事で共有する
+    const auto masks = make_group_masks(bg, ed, imgMap);
+    auto maskOf = [&](Iter it) -> GroupMask const * {
+        return masks.empty() ? nullptr : masks.data() + std::distance(bg, it);
+    };
+
+    auto solve = [&](Iter it, SearchMap m){
+        if(bound)
+            return position_bnb(it, ed, m, maskOf(it), remain, pb, pred, *bound, incumbent, progress, tt);
+        else
+            return position_bfs(it, ed, m, maskOf(it), remain, pb, pred, progress, tt);
+    };
+
+    // 木の何段目までを分割するか
+    const std::size_t splitDepth = std::min<std::size_t>(std::distance(bg, ed), 2);
+
+    std::mutex mtx;
+    double bestV = std::numeric_limits<double>::infinity();
+    std::vector<std::size_t> bestKey;
+    TileMap bestMap;
+
+    WorkStealingPool pool(nThreads);
+
+    // keyは、これまでに置いたグループのアンカーの位置の列
+    std::function<void(Iter, SearchMap const &, std::vector<std::size_t> const &)> expand
+      = [&](Iter it, SearchMap const & map, std::vector<std::size_t> const & key)
+    {
+        if(key.size() == splitDepth){
+            auto res = solve(it, map);
+
+            std::lock_guard<std::mutex> lk(mtx);
+            if(std::get<0>(res) < bestV || (std::get<0>(res) == bestV && key > bestKey)){
+                bestV = std::get<0>(res);
+                bestKey = key;
+                bestMap = std::move(std::get<1>(res));
             }
+            return;
+        }
+
+        if(progress) progress->check();
+
+        Group const & g = *it;
+        foreach_fit_anchor(g, maskOf(it), map, [&](size_t i, size_t j){
+            SearchMap child = map;
+            set_opt_map(g, child, i, j);
+
+            if(bound && incumbent.prunes((*bound)(child.map)))
+                return;
+
+            std::vector<std::size_t> childKey = key;
+            childKey.push_back(i * pb.div_x() + j);
+
+            pool.submit([&expand, it, child, childKey](){ expand(it + 1, child, childKey); });
         });
+    };
+
+    pool.submit([&](){ expand(bg, SearchMap(imgMap), std::vector<std::size_t>()); });
+    pool.wait();
+
+    return std::make_tuple(bestV, std::move(bestMap));
+}
+
+
+/** グループの配置をビームサーチで探します。
+グループを一つずつ置き、各段で下界の小さい順にwidth個の配置だけを残します。
+最後の段に残った配置について残りの断片を埋め、最も評価値の良いものを返します。
+
+幅1から始めて、時間の許す限り幅を倍にしながら探索し直し、それまでで最良のものを返します。
+幅1の探索は期限を過ぎても最後まで行います。
+残した配置がすべて行き詰まる(後のグループを置ける位置がない)と配置が一つも見つからないので、
+そのときは期限によらずposition_bnbですべての配置を調べ直します。
+それでも見つからなければ、position_bnbと同じく評価値が無限大の空の配置を返します。
+*/
+template <typename Iter>
+std::tuple<double, TileMap>
+    position_beam(Iter bg, Iter ed,
+                  OptionalMap const & imgMap,
+                  Remains const & remain,
+                  Problem const & pb,
+                  CostTable const & pred,
+                  std::size_t width,
+                  std::chrono::steady_clock::time_point deadline,
+                  GuessProgress* progress = nullptr,
+                  TranspositionTable* tt = nullptr)
+{
+    PROCON_TRACE_SCOPE("position_beam");
+
+    auto best = std::make_tuple(std::numeric_limits<double>::infinity(), TileMap());
+
+    if(bg == ed){
+        auto dst = evaluate_leaf(imgMap, remain, pred, tt);
+        if(progress) progress->report(std::get<0>(dst));
+
+        return dst;
+    }
+
+    const PlacementBound bound(collect_ids(bg, ed, imgMap, remain), pred);
+    const auto masks = make_group_masks(bg, ed, imgMap);
+
+    struct Node
+    {
+        double bound;
+        SearchMap map;
+    };
+
+    auto expired = [&](){ return std::chrono::steady_clock::now() >= deadline; };
+
+    // 幅wで一回探索する。期限を過ぎた場合はfalseを返す
+    auto search = [&](std::size_t w, bool mustFinish) -> bool {
+        std::vector<Node> beam(1, Node{bound(imgMap), SearchMap(imgMap)});
+
+        for(Iter it = bg; it != ed; ++it){
+            Group const & g = *it;
+            GroupMask const * mask = masks.empty() ? nullptr : masks.data() + std::distance(bg, it);
+
+            std::vector<Node> children;
+            for(auto& n: beam){
+                if(progress) progress->check();
+                if(!mustFinish && expired()) return false;
+
+                foreach_fit_anchor(g, mask, n.map, [&](size_t i, size_t j){
+                    SearchMap child = n.map;
+                    set_opt_map(g, child, i, j);
+
+                    const double b = bound(child.map);
+                    children.push_back(Node{b, std::move(child)});
+                });
+            }
+
+            // 下界が同じなら生成した順(親の順位、アンカーの行優先の順)に残す
+            std::stable_sort(children.begin(), children.end(), [](Node const & a, Node const & b){ return a.bound < b.bound; });
+            if(children.size() > w)
+                children.erase(children.begin() + w, children.end());
+
+            beam = std::move(children);
+        }
+
+        for(auto& n: beam){
+            if(progress) progress->check();
+            if(!mustFinish && expired()) return false;
+
+            // 幅を広げて探索し直すと同じ配置が何度も残るので、ttが効く
+            auto res = evaluate_leaf(n.map.map, remain, pred, tt);
+            if(progress) progress->report(std::get<0>(res));
+
+            if(std::get<0>(res) < std::get<0>(best))
+                best = std::move(res);
+        }
+
+        return true;
+    };
+
+    width = std::max<std::size_t>(width, 1);
+    for(std::size_t w = 1; ; w = std::min(w * 2, width)){
+        if(!search(w, w == 1) || w == width)
+            break;
+    }
+
+    if(std::get<1>(best).empty()){
+        Incumbent incumbent;
+        best = position_bnb(bg, ed, imgMap, remain, pb, pred, bound, incumbent, progress, tt);
+    }
+
+    return best;
+}
+
+
+// refine_placementで入れ替えるブロックの最大の長さ
+constexpr std::size_t refineMaxBlock = 3;
+
+
+/** 局所探索の一手。
+cell1とcell2から始まる長さlenのブロック(verticalなら縦、そうでなければ横)どうしを入れ替えます。
+lenが1なら、二つの断片の入れ替えです。
+*/
+struct RefineMove
+{
+    std::size_t cell1, cell2;
+    std::size_t len;
+    bool vertical;
+    double delta;           // 入れ替えによる評価値の変化
+};
+
+
+/** 配置mapにmvを行ったときの評価値の変化。
+入れ替わる断片に接する継ぎ目だけを計算します。
+*/
+double refine_delta(TileMap const & map, CostTable const & table, RefineMove const & mv)
+{
+    const std::size_t rows = map.rows(),
+                      cols = map.cols(),
+                      step = mv.vertical ? cols : 1;
+
+    // 入れ替わる位置と、入れ替え後の断片
+    std::array<std::tuple<std::size_t, TileNo>, 2 * refineMaxBlock> changed;
+    std::size_t nChanged = 0;
+    for(std::size_t k = 0; k < mv.len; ++k){
+        const std::size_t a = mv.cell1 + k * step,
+                          b = mv.cell2 + k * step;
+        changed[nChanged++] = std::make_tuple(a, map[b]);
+        changed[nChanged++] = std::make_tuple(b, map[a]);
+    }
+
+    auto after = [&](std::size_t c){
+        for(std::size_t k = 0; k < nChanged; ++k)
+            if(std::get<0>(changed[k]) == c)
+                return std::get<1>(changed[k]);
+
+        return map[c];
+    };
+
+    // 継ぎ目は、上(左)の位置と向きで表す。同じ継ぎ目を二度数えないように並べて重複を除く
+    std::array<std::size_t, 2 * refineMaxBlock * 4> seams;
+    std::size_t nSeams = 0;
+    for(std::size_t k = 0; k < nChanged; ++k){
+        const std::size_t c = std::get<0>(changed[k]),
+                          i = c / cols,
+                          j = c % cols;
+
+        if(i > 0)           seams[nSeams++] = (c - cols) * 2;
+        if(i + 1 < rows)    seams[nSeams++] = c * 2;
+        if(j > 0)           seams[nSeams++] = (c - 1) * 2 + 1;
+        if(j + 1 < cols)    seams[nSeams++] = c * 2 + 1;
+    }
+    std::sort(seams.begin(), seams.begin() + nSeams);
+    nSeams = std::unique(seams.begin(), seams.begin() + nSeams) - seams.begin();
+
+    const auto down = direction_index(Direction::down),
+               right = direction_index(Direction::right);
+
+    double delta = 0;
+    for(std::size_t k = 0; k < nSeams; ++k){
+        const std::size_t c = seams[k] / 2;
+        const bool isDown = (seams[k] % 2) == 0;
+        const std::size_t c2 = isDown ? c + cols : c + 1;
+        const auto dir = isDown ? down : right;
+
+        delta += table.cost(after(c), after(c2), dir) - table.cost(map[c], map[c2], dir);
+    }
+
+    return delta;
+}
+
+
+/** 配置mapのうち、movableな位置の断片だけを入れ替えて評価値を下げます。
+一手は、二つの断片の入れ替えか、長さrefineMaxBlockまでの縦横のブロックどうしの入れ替えです。
+
+一巡ごとに、各位置から始まる手のうち最も良くなるものを並列に探し、
+良くなる順に、その時点の配置でまだ良くなるものだけを行います。
+良くなる手がなくなるか、maxRounds巡するか、期限を過ぎたら止めます。
+各位置で探す手は位置ごとに決まっているので、結果はスレッド数によりません。
+*/
+std::tuple<double, TileMap>
+    refine_placement(TileMap map,
+                     Grid<std::uint8_t> const & movable,
+                     CostTable const & table,
+                     std::size_t nThreads,
+                     std::size_t maxRounds,
+                     std::chrono::steady_clock::time_point deadline,
+                     GuessProgress* progress = nullptr)
+{
+    PROCON_TRACE_SCOPE("refine_placement");
+
+    constexpr double eps = 1e-9;
+    const std::size_t rows = map.rows(),
+                      cols = map.cols(),
+                      n = map.size();
+
+    // cellから縦(横)に長さlenのブロックが取れるか
+    auto blockFits = [&](std::size_t cell, std::size_t len, bool vertical){
+        const std::size_t i = cell / cols,
+                          j = cell % cols;
+        if(vertical ? i + len > rows : j + len > cols)
+            return false;
+
+        for(std::size_t k = 0; k < len; ++k)
+            if(!movable[cell + k * (vertical ? cols : 1)])
+                return false;
+
+        return true;
+    };
+
+    auto disjoint = [&](RefineMove const & mv){
+        if(mv.len == 1)
+            return true;
+
+        const std::size_t step = mv.vertical ? cols : 1;
+        for(std::size_t k = 0; k < mv.len; ++k)
+            for(std::size_t l = 0; l < mv.len; ++l)
+                if(mv.cell1 + k * step == mv.cell2 + l * step)
+                    return false;
+
+        return true;
+    };
+
+    WorkStealingPool pool(nThreads);
+    std::vector<boost::optional<RefineMove>> best(n);
+
+    for(std::size_t round = 0; round < maxRounds; ++round){
+        if(progress) progress->check();
+        if(std::chrono::steady_clock::now() >= deadline)
+            break;
+
+        // 各位置aから始まる手のうち、最も良くなるもの
+        for(std::size_t a = 0; a < n; ++a){
+            best[a] = boost::none;
+            if(!movable[a])
+                continue;
+
+            pool.submit([&, a](){
+                for(std::size_t len = 1; len <= refineMaxBlock; ++len)
+                    for(bool vertical: {false, true}){
+                        if((len == 1 && vertical) || !blockFits(a, len, vertical))
+                            continue;
+
+                        for(std::size_t b = a + 1; b < n; ++b){
+                            RefineMove mv = {a, b, len, vertical, 0};
+                            if(!blockFits(b, len, vertical) || !disjoint(mv))
+                                continue;
+
+                            mv.delta = refine_delta(map, table, mv);
+                            if(mv.delta < -eps && (!best[a] || mv.delta < best[a]->delta))
+                                best[a] = mv;
+                        }
+                    }
+            });
+        }
+        pool.wait();
+
+        std::vector<RefineMove> moves;
+        for(auto& mv: best)
+            if(mv) moves.push_back(*mv);
+
+        std::stable_sort(moves.begin(), moves.end(), [](RefineMove const & x, RefineMove const & y){ return x.delta < y.delta; });
+
+        // 先に行った手で周りが変わっているので、行う直前に計算し直す
+        std::size_t nApplied = 0;
+        for(auto& mv: moves){
+            if(refine_delta(map, table, mv) >= -eps)
+                continue;
+
+            const std::size_t step = mv.vertical ? cols : 1;
+            for(std::size_t k = 0; k < mv.len; ++k)
+                std::swap(map[mv.cell1 + k * step], map[mv.cell2 + k * step]);
+
+            ++nApplied;
+        }
+
+        PROCON_TRACE_COUNT("refine moves", nApplied);
+        if(nApplied == 0)
+            break;
+    }
+
+    const double val = calcAllValue(map, table);
+    if(progress) progress->report(val);
+
+    return std::make_tuple(val, std::move(map));
+}
+
+
+/** interactive_guessの探索の設定
+*/
+struct GuessOption
+{
+    GuessOption()
+    : threads(std::max<std::size_t>(std::thread::hardware_concurrency(), 1)),
+      mode(SearchMode::branchAndBound), progress(nullptr), tt(nullptr),
+      beamWidth(64), timeBudget(2000),
+      refine(false), refineRounds(32), refineBudget(500) {}
+
+    std::size_t threads;        // 探索に使うスレッド数。1なら逐次に探索します
+    SearchMode mode;
+    GuessProgress* progress;    // 進み具合の報告先。nullptrなら報告しません
+    TranspositionTable* tt;     // 評価の結果を使い回す表。tableと同じ評価関数のものを渡してください
+
+    // SearchMode::beamのときだけ使われます
+    std::size_t beamWidth;                  // ビームの最大幅
+    std::chrono::milliseconds timeBudget;   // 探索と、refineなら局所探索とを合わせてかける時間
+
+    // refineなら、探索の結果をrefine_placementで改善します。固定(赤)とグループ(青)は動かしません
+    bool refine;
+    std::size_t refineRounds;               // 局所探索の最大の巡回数
+    std::chrono::milliseconds refineBudget; // 局所探索にかける時間。SearchMode::beamのときはtimeBudgetのうちこの時間(最大で1/4)を局所探索に残し、探索が早く終われば残り全部を使います
+};
+
+
+/** interactive_guessが解く問題
+*/
+struct GuessProblem
+{
+    OptionalMap map;                // 固定された断片(赤)だけを置いた地図
+    std::vector<Group> groups;      // 相対位置が固定された断片(青)の組
+    Remains remain;                 // 残りの断片
+};
+
+
+/** 並びと断片の状態から、interactive_guessが解く問題を作ります
+*/
+GuessProblem make_guess_problem(ImgMap const & imgIdx, Grid<TileState> const & states, TileCatalog const & catalog)
+{
+    GuessProblem dst;
+
+    auto gps = [&](){
+        std::vector<Group> gps;
+        for(size_t i = 0; i < imgIdx.rows(); ++i)
+            for(size_t j = 0; j < imgIdx.cols(); ++j)
+                if(states(i, j).isGrouped()){
+                    const auto gId = states(i, j).groupId();
+                    if(gps.size() <= gId)
+                        gps.resize(gId + 1);
+
+                    gps[gId].emplace_back(catalog.number(imgIdx(i, j)),
+                        std::array<std::ptrdiff_t, 2>({static_cast<std::ptrdiff_t>(i),
+                                                       static_cast<std::ptrdiff_t>(j)}));
+                }
 
         return gps;
     }();
 
-    std::vector<Group> groups;
     for (auto& e : gps)
         if (e.size() > 1)
-            groups.emplace_back(std::move(e));
+            dst.groups.emplace_back(std::move(e));
 
-    for (auto& g : groups){
+    for (auto& g : dst.groups){
         std::array<std::ptrdiff_t, 2> f = std::get<1>(g[0]);
         for (auto& e : g){
             auto& l = std::get<1>(e);
@@ -258,19 +1201,133 @@ ImgMap interactive_guess(Parameter const & param, Problem const & pb, BinFunc co
         }
     }
 
-    Remains remain;
-    OptionalMap imgMap(pb.div_y());
-    DividedImage::foreach(pb, [&](size_t i, size_t j){
-        if(param.tileState[i][j].isFree())
-            remain.emplace(imgIdx[i][j]);
+    dst.map = OptionalMap(imgIdx.rows(), imgIdx.cols(), noTile);
+    for(size_t i = 0; i < imgIdx.rows(); ++i)
+        for(size_t j = 0; j < imgIdx.cols(); ++j){
+            if(states(i, j).isFree())
+                dst.remain.emplace_back(catalog.number(imgIdx(i, j)));
+
+            if(states(i, j).isFixed())
+                dst.map(i, j) = catalog.number(imgIdx(i, j));
+        }
+
+    return dst;
+}
+
+
+/** 固定された断片(赤)とグループ(青)を保ったまま、残りの断片の配置を推定します。
+並びと状態はスナップショットとして受け取るので、別スレッドから呼び出せます。
+*/
+ImgMap interactive_guess(ImgMap const & imgIdx, Grid<TileState> const & states, Problem const & pb, CostTable const & table, GuessOption const & opt = GuessOption())
+{
+    PROCON_TRACE_SCOPE("interactive_guess");
+
+    auto gp = make_guess_problem(imgIdx, states, table.catalog());
+
+    // ビームサーチでは、局所探索もtimeBudgetの内で行う。
+    // 探索が期限まで使い切っても局所探索が動けるよう、refineBudget(ただしtimeBudgetの1/4まで)を残して探索を打ち切る
+    const auto deadline = std::chrono::steady_clock::now() + opt.timeBudget;
+    const auto beamDeadline = opt.refine
+        ? deadline - std::min<std::chrono::steady_clock::duration>(opt.refineBudget, opt.timeBudget / 4)
+        : deadline;
+
+    auto res = (opt.mode == SearchMode::beam)
+        ? position_beam(gp.groups.begin(), gp.groups.end(), gp.map, gp.remain, pb, table,
+                        opt.beamWidth, beamDeadline, opt.progress, opt.tt)
+        : position_bfs_parallel(gp.groups.begin(), gp.groups.end(), gp.map, gp.remain, pb, table, opt.threads, opt.mode, opt.progress, opt.tt);
+
+    // 固定やグループの置き方によっては、すべての断片を置ける配置がない
+    if(std::get<1>(res).empty())
+        throw std::runtime_error("Error: no placement satisfies the fixed and grouped tiles.");
+
+    if(opt.refine){
+        // 残りの断片(fill_remain_tileで埋めたもの)の位置だけを動かす
+        std::vector<std::uint8_t> isRemain(table.catalog().size(), 0);
+        for(auto t: gp.remain)
+            isRemain[t] = 1;
+
+        auto const & map = std::get<1>(res);
+        Grid<std::uint8_t> movable(map.rows(), map.cols(), 0);
+        for(std::size_t k = 0; k < map.size(); ++k)
+            movable[k] = isRemain[map[k]];
+
+        const auto refineDeadline = (opt.mode == SearchMode::beam)
+            ? deadline : std::chrono::steady_clock::now() + opt.refineBudget;
+        res = refine_placement(std::move(std::get<1>(res)), movable, table, opt.threads,
+                               opt.refineRounds, refineDeadline, opt.progress);
+    }
+    PROCON_TRACE_COUNTERS();
+
+    return to_img_map(std::get<1>(res), table.catalog());
+}
 
-        if(param.tileState[i][j].isFixed())
-            imgMap[i].emplace_back(imgIdx[i][j]);
-        else
-            imgMap[i].emplace_back(boost::none);
-    });
 
-    return std::get<1>(position_bfs(groups.begin(), groups.end(), imgMap, remain, pb, pred));
+/** portfolio_guessで使う評価関数の一つ
+*/
+struct PortfolioEntry
+{
+    std::string name;           // 状態表示欄に出す名前
+    CostTable const * table;
+    TranspositionTable* tt;     // tableに対応する表。nullptrなら使いません
+};
+
+
+/** 推定結果の候補
+*/
+struct GuessCandidate
+{
+    std::string name;
+    CostTable const * table;    // 推定に使った評価関数
+    ImgMap index;
+    double score;               // portfolio_guessのscorerでの評価値
+};
+
+
+/** 同じ並びと状態から、entriesの各評価関数での推定を別々のスレッドで同時に行います。
+スレッドはopt.threadsを等分します。候補は、共通の物差しscorerでの評価値の良い順に並べます。
+*/
+std::vector<GuessCandidate> portfolio_guess(ImgMap const & imgIdx, Grid<TileState> const & states, Problem const & pb,
+                                            std::vector<PortfolioEntry> const & entries, CostTable const & scorer,
+                                            GuessOption const & opt = GuessOption())
+{
+    PROCON_TRACE_SCOPE("portfolio_guess");
+
+    std::vector<std::future<ImgMap>> results;
+    for(auto& e: entries){
+        GuessOption o = opt;
+        o.threads = std::max<std::size_t>(opt.threads / entries.size(), 1);
+        o.tt = e.tt;
+
+        CostTable const & table = *e.table;
+        results.push_back(std::async(std::launch::async, [&imgIdx, &states, &pb, &table, o](){
+            return interactive_guess(imgIdx, states, pb, table, o);
+        }));
+    }
+
+    std::vector<GuessCandidate> dst;
+    for(std::size_t i = 0; i < entries.size(); ++i){
+        auto index = results[i].get();
+        const double score = calcAllValue(index, scorer);
+        dst.push_back(GuessCandidate{entries[i].name, entries[i].table, std::move(index), score});
+    }
+
+    std::stable_sort(dst.begin(), dst.end(), [](GuessCandidate const & a, GuessCandidate const & b){ return a.score < b.score; });
+    return dst;
+}
+
+
+ImgMap interactive_guess(Parameter const & param, Problem const & pb, CostTable const & table, GuessOption const & opt = GuessOption())
+{
+    return interactive_guess(param.swpImage.get_index(), param.states(), pb, table, opt);
+}
+
+
+/** predがCostTableでなければ、その場で表を作ってから探索します
+*/
+template <typename BinFunc>
+ImgMap interactive_guess(Parameter const & param, Problem const & pb, BinFunc const & pred, GuessOption const & opt = GuessOption())
+{
+    return interactive_guess(param, pb, CostTable(param.swpImage.get_index(), pred, opt.threads), opt);
 }
 
 
@@ -0,0 +1,467 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <boost/optional.hpp>
+
+#include "../utils/include/types.hpp"
+#include "../utils/include/exception.hpp"
+#include "../utils/include/dwrite.hpp"
+#include "common.hpp"
+#include "event_log.hpp"
+#include "grid.hpp"
+
+
+namespace procon { namespace modify {
+
+
+/** 修正作業を再開するための記録の一件
+*/
+struct JournalRecord
+{
+    enum class Kind : char
+    {
+        operation = 'o',    // 並びか状態を変える操作
+        save = 's',         // 新しい操作(ジェスチャ)の始まり
+        restore = 'u',      // 一つ前の操作の取り消し
+        redo = 'r',         // 取り消した操作のやり直し
+        checkpoint = 'c',   // その時点の並びと状態の全体
+    };
+
+    Kind kind;
+    Operation op;                       // operationのとき
+    Grid<std::uint16_t> tiles;          // checkpointのとき、各位置の断片の、初期の並びでの通し番号
+    Grid<TileState> states;             // checkpointのとき、各位置の断片の状態
+};
+
+
+/** 読み込んだ記録のうち、壊れていない先頭部分
+*/
+struct JournalContents
+{
+    std::vector<JournalRecord> records;
+    std::string bytes;      // recordsに対応する、ヘッダを含めたファイルの先頭部分
+    bool torn;              // 末尾に書きかけの記録があったか
+};
+
+
+/** 修正作業の操作と履歴を、バイナリ形式でファイルの末尾へ追記していきます。
+書式は、16バイトのヘッダ
+    "PMJ1" <初期の並びのindex_digest:8> <div_y:2> <div_x:2>
+に続けて、一文字の種類から始まる記録が並びます(整数はリトルエンディアン)。
+    'o' <Operation::Kind:1> <isRow | forward << 1:1> <idx1:2*2> <idx2:2*2> <before:1> <after:1>
+    's' 'u' 'r'
+    'c' <各位置の断片の初期の並びでの通し番号:2*div_y*div_x> <各位置の状態:1*div_y*div_x>
+
+書き込みは専用のスレッドが行い、メインループは記録をバッファへ積むだけです。
+書き込むたびにflushするので、異常終了しても直前の操作までは残り、書きかけの記録は読み込むときに捨てます。
+'c'はenterとescを押したときと、checkpointInterval件ごとに書き、再開するときはそこから後ろの記録だけを再生します。
+*/
+class SessionJournal : public HistoryObserver
+{
+  public:
+    /** pathの記録を読み込みます。
+    ファイルがないか、beforeから始めた修正作業の記録でなければnoneを返します。
+    */
+    static boost::optional<JournalContents> read(std::string const & path, std::vector<std::vector<utils::ImageID>> const & before)
+    {
+        std::ifstream is(path, std::ios::binary);
+        if(!is.is_open())
+            return boost::none;
+
+        const std::string bytes((std::istreambuf_iterator<char>(is)), std::istreambuf_iterator<char>());
+        if(bytes.size() < headerBytes || bytes.compare(0, headerBytes, header(before)) != 0)
+            return boost::none;
+
+        const std::size_t divY = before.size(),
+                          divX = before[0].size(),
+                          n = divY * divX;
+
+        JournalContents dst;
+        std::size_t pos = headerBytes;
+        while(pos < bytes.size()){
+            JournalRecord rec = {};
+            rec.kind = static_cast<JournalRecord::Kind>(bytes[pos]);
+
+            // 種類や中身が読めなければ、書きかけのまま終わった部分とみなし、そこから後ろは捨てる
+            std::size_t len = 1;
+            bool known = true;
+            switch(rec.kind){
+              case JournalRecord::Kind::operation:
+                len += operationBytes;
+                break;
+
+              case JournalRecord::Kind::save:
+              case JournalRecord::Kind::restore:
+              case JournalRecord::Kind::redo:
+                break;
+
+              case JournalRecord::Kind::checkpoint:
+                len += n * 3;
+                break;
+
+              default:
+                known = false;
+            }
+
+            if(!known || pos + len > bytes.size())
+                break;
+
+            const char* p = bytes.data() + pos + 1;
+            bool valid = true;
+            if(rec.kind == JournalRecord::Kind::operation){
+                Operation& op = rec.op;
+                op.kind = static_cast<Operation::Kind>(get8(p));
+                const std::uint8_t flags = get8(p + 1);
+                op.isRow = (flags & 1) != 0;
+                op.forward = (flags & 2) != 0;
+                op.idx1[0] = get16(p + 2); op.idx1[1] = get16(p + 4);
+                op.idx2[0] = get16(p + 6); op.idx2[1] = get16(p + 8);
+                op.before = TileState::fromRaw(get8(p + 10));
+                op.after = TileState::fromRaw(get8(p + 11));
+
+                valid = op.kind <= Operation::Kind::shift
+                     && op.idx1[0] < divY && op.idx1[1] < divX && op.idx2[0] < divY && op.idx2[1] < divX
+                     && get8(p + 10) <= maxStateRaw && get8(p + 11) <= maxStateRaw;
+            }
+            else if(rec.kind == JournalRecord::Kind::checkpoint){
+                rec.tiles = Grid<std::uint16_t>(divY, divX);
+                rec.states = Grid<TileState>(divY, divX);
+
+                // 各断片がちょうど一回ずつ現れなければならない
+                std::vector<bool> seen(n, false);
+                for(std::size_t k = 0; k < n && valid; ++k){
+                    rec.tiles[k] = get16(p + k * 2);
+                    rec.states[k] = TileState::fromRaw(get8(p + n * 2 + k));
+
+                    valid = rec.tiles[k] < n && !seen[rec.tiles[k]] && get8(p + n * 2 + k) <= maxStateRaw;
+                    if(valid) seen[rec.tiles[k]] = true;
+                }
+            }
+
+            if(!valid)
+                break;
+
+            dst.records.push_back(std::move(rec));
+            pos += len;
+        }
+
+        dst.torn = pos != bytes.size();
+        dst.bytes = bytes.substr(0, pos);
+        return dst;
+    }
+
+
+    /** beforeから始めた修正作業の記録を、pathへ書き出し始めます。
+    resumedを与えると、その続きとして追記します。
+    与えずにpathが既にあれば、上書きせずにpath.oldへ退避します。
+    開けないときや退避できないときは、書き出さずに作業を続けられるよう記録を捨て、goodをfalseにします。
+    */
+    SessionJournal(std::string const & path, std::vector<std::vector<utils::ImageID>> const & before, JournalContents const * resumed)
+    : _tileNo(), _sinceCheckpoint(0), _os(), _mutex(), _cv(), _pending(), _stop(false), _failed(false), _writer()
+    {
+        for(std::size_t i = 0; i < before.size(); ++i)
+            for(std::size_t j = 0; j < before[i].size(); ++j)
+                _tileNo.emplace(before[i][j], static_cast<std::uint16_t>(i * before[i].size() + j));
+
+        if(resumed && !resumed->torn)
+            _os.open(path, std::ios::binary | std::ios::app);
+        else{
+            bool moved = true;
+            if(!resumed && std::ifstream(path).is_open()){
+                const std::string old = path + ".old";
+                std::remove(old.c_str());
+                moved = std::rename(path.c_str(), old.c_str()) == 0;
+            }
+
+            // 退避できなかった記録は、上書きせずに残しておく
+            if(moved){
+                // 書きかけの記録は、壊れていない部分だけを書き直して取り除く
+                _os.open(path, std::ios::binary | std::ios::trunc);
+                _pending = resumed ? resumed->bytes : header(before);
+            }
+            else
+                utils::writeln("Error: cannot move the session journal to " + path + ".old");
+        }
+
+        if(!_os.is_open()){
+            utils::writeln("Error: cannot open the session journal " + path + "; continuing without it");
+            _failed = true;
+            _pending.clear();
+            return;
+        }
+
+        _writer = std::thread([this]{ run(); });
+    }
+
+
+    SessionJournal(SessionJournal const &) = delete;
+    SessionJournal& operator=(SessionJournal const &) = delete;
+
+
+    /** まだ書き出していない記録を書き出してから閉じます
+    */
+    ~SessionJournal()
+    {
+        {
+            std::lock_guard<std::mutex> lk(_mutex);
+            _stop = true;
+        }
+        _cv.notify_one();
+
+        if(_writer.joinable())
+            _writer.join();
+    }
+
+
+    void on_operation(Operation const & op) override
+    {
+        std::string rec(1, static_cast<char>(JournalRecord::Kind::operation));
+        put8(rec, static_cast<std::uint8_t>(op.kind));
+        put8(rec, (op.isRow ? 1 : 0) | (op.forward ? 2 : 0));
+        put16(rec, op.idx1[0]); put16(rec, op.idx1[1]);
+        put16(rec, op.idx2[0]); put16(rec, op.idx2[1]);
+        put8(rec, op.before.raw());
+        put8(rec, op.after.raw());
+        push(rec);
+    }
+
+
+    void on_save() override { push(std::string(1, static_cast<char>(JournalRecord::Kind::save))); }
+    void on_restore() override { push(std::string(1, static_cast<char>(JournalRecord::Kind::restore))); }
+    void on_redo() override { push(std::string(1, static_cast<char>(JournalRecord::Kind::redo))); }
+
+
+    /** 現在の並びと状態の全体を記録します。
+    再開するときはここから後ろだけを再生し、それより前の区切りから再生したときは、ここで正しく再現できたかを確かめます。
+    */
+    void checkpoint(Parameter const & param)
+    {
+        _sinceCheckpoint = 0;
+
+        auto& index = param.swpImage.get_index();
+        const auto states = param.states();
+
+        std::string rec(1, static_cast<char>(JournalRecord::Kind::checkpoint));
+        for(auto& e: index)
+            put16(rec, _tileNo.at(e));
+
+        for(std::size_t k = 0; k < states.size(); ++k)
+            put8(rec, states[k].raw());
+
+        push(rec);
+    }
+
+
+    /** 前の区切りからcheckpointInterval件以上記録していればtrue。
+    再開するときに再生する記録の数を抑えるため、メインループはこのときcheckpointを呼びます。
+    */
+    bool wants_checkpoint() const { return _sinceCheckpoint >= checkpointInterval; }
+
+
+    /** 書き込みに失敗していればfalse
+    */
+    bool good() const
+    {
+        std::lock_guard<std::mutex> lk(_mutex);
+        return !_failed;
+    }
+
+
+  private:
+    static constexpr std::size_t headerBytes = 16,
+                                 operationBytes = 12,
+                                 checkpointInterval = 4096;
+
+    // 状態の1バイトの表現が取りうる最大の値。グループはgroupedColorの数(2つ)までしか表示できない
+    static constexpr std::uint8_t maxStateRaw = 3;
+
+
+    static std::string header(std::vector<std::vector<utils::ImageID>> const & before)
+    {
+        std::string dst = "PMJ1";
+        put64(dst, index_digest(before));
+        put16(dst, static_cast<std::uint16_t>(before.size()));
+        put16(dst, static_cast<std::uint16_t>(before.empty() ? 0 : before[0].size()));
+        return dst;
+    }
+
+
+    static void put8(std::string& dst, std::uint8_t v) { dst.push_back(static_cast<char>(v)); }
+    static void put16(std::string& dst, std::uint16_t v) { put8(dst, v & 0xff); put8(dst, v >> 8); }
+    static void put64(std::string& dst, std::uint64_t v) { for(int k = 0; k < 8; ++k) put8(dst, (v >> (k * 8)) & 0xff); }
+
+    static std::uint8_t get8(char const * p) { return static_cast<std::uint8_t>(*p); }
+    static std::uint16_t get16(char const * p) { return get8(p) | (get8(p + 1) << 8); }
+
+
+    // メインループからだけ呼ばれる
+    void push(std::string const & rec)
+    {
+        ++_sinceCheckpoint;
+
+        // 開けなかったときは、書き出す先がないので積まない
+        if(!_writer.joinable())
+            return;
+
+        {
+            std::lock_guard<std::mutex> lk(_mutex);
+            _pending += rec;
+        }
+        _cv.notify_one();
+    }
+
+
+    // 積まれた記録をまとめて書き出す
+    void run()
+    {
+        std::unique_lock<std::mutex> lk(_mutex);
+        while(1){
+            _cv.wait(lk, [&]{ return _stop || !_pending.empty(); });
+            if(_pending.empty())
+                break;
+
+            std::string buf;
+            buf.swap(_pending);
+            lk.unlock();
+
+            _os.write(buf.data(), buf.size());
+            _os.flush();
+            const bool failed = !_os.good();
+
+            lk.lock();
+            _failed = _failed || failed;
+        }
+    }
+
+
+    std::unordered_map<utils::ImageID, std::uint16_t> _tileNo;     // 断片の、初期の並びでの通し番号
+    std::size_t _sinceCheckpoint;                                   // 前の区切りから積んだ記録の数
+    std::ofstream _os;
+
+    mutable std::mutex _mutex;
+    std::condition_variable _cv;
+    std::string _pending;       // まだ書き出していない記録
+    bool _stop;
+    bool _failed;
+    std::thread _writer;
+};
+
+
+namespace journal_detail {
+
+// records[start]から後ろの元に戻す/やり直しが、その時点の履歴がなくても同じ結果になるか
+inline bool replayable_from(std::vector<JournalRecord> const & records, std::size_t start)
+{
+    std::size_t nUndo = 0, nRedo = 0;   // startより後に積まれた、戻せる操作とやり直せる操作の数
+    for(std::size_t k = start; k < records.size(); ++k)
+        switch(records[k].kind){
+          case JournalRecord::Kind::save:
+            ++nUndo;
+            nRedo = 0;
+            break;
+
+          case JournalRecord::Kind::restore:
+            if(nUndo == 0) return false;
+            --nUndo; ++nRedo;
+            break;
+
+          case JournalRecord::Kind::redo:
+            if(nRedo == 0) return false;
+            --nRedo; ++nUndo;
+            break;
+
+          default:
+            break;
+        }
+
+    return true;
+}
+
+
+inline Grid<utils::ImageID> checkpoint_index(JournalRecord const & rec, std::vector<std::vector<utils::ImageID>> const & before)
+{
+    const std::size_t divX = before[0].size();
+
+    Grid<utils::ImageID> dst(rec.tiles.rows(), rec.tiles.cols());
+    for(std::size_t k = 0; k < dst.size(); ++k)
+        dst[k] = before[rec.tiles[k] / divX][rec.tiles[k] % divX];
+
+    return dst;
+}
+
+} // namespace journal_detail
+
+
+/** 記録された並びと状態、履歴をparamで再現します。
+paramはbeforeの並びから何も操作していないものでなければなりません。
+
+最後の区切り('c')のうち、その後ろの記録をそこからの履歴だけで再現できるものから再生するので、
+zキーで戻せるのはその区切りまでです。そのような区切りがなければ初めから再生します。
+再生した記録の数を返します。途中の区切りと結果が合わなければnoneを返し、paramは使えない状態になります。
+*/
+inline boost::optional<std::size_t> resume_session(Parameter& param, std::vector<std::vector<utils::ImageID>> const & before, JournalContents const & contents)
+{
+    auto& records = contents.records;
+
+    std::size_t start = records.size();
+    while(start != 0){
+        --start;
+        if(records[start].kind == JournalRecord::Kind::checkpoint && journal_detail::replayable_from(records, start + 1))
+            break;
+    }
+
+    // 区切りから始めるときは、その並びと状態を履歴に残さずに反映する
+    std::size_t k = 0;
+    if(start < records.size() && records[start].kind == JournalRecord::Kind::checkpoint){
+        auto& cp = records[start];
+        param.apply_index(journal_detail::checkpoint_index(cp, before));
+        utils::DividedImage::foreach(param.swpImage, [&](std::size_t i, std::size_t j){
+            param.modify_state(i, j, [&](TileState& st){ st = cp.states(i, j); });
+        });
+
+        k = start + 1;
+    }
+
+    const std::size_t first = k;
+    for(; k < records.size(); ++k){
+        auto& rec = records[k];
+        switch(rec.kind){
+          case JournalRecord::Kind::operation:
+            param.perform(rec.op);
+            break;
+
+          case JournalRecord::Kind::save:
+            param.save();
+            break;
+
+          case JournalRecord::Kind::restore:
+            param.restore();
+            break;
+
+          case JournalRecord::Kind::redo:
+            param.redo();
+            break;
+
+          case JournalRecord::Kind::checkpoint:
+            if(!(param.swpImage.get_index() == journal_detail::checkpoint_index(rec, before)
+              && param.states() == rec.states))
+                return boost::none;
+            break;
+        }
+    }
+
+    return records.size() - first;
+}
+
+
+}}
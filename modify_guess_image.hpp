@@ -6,6 +6,9 @@
 #include <future>
 #include <algorithm>
 #include <stack>
+#include <chrono>
+#include <functional>
+#include <thread>
 
 #include "../inout/include/inout.hpp"
 #include "../utils/include/types.hpp"
@@ -16,7 +19,13 @@
 #include "../guess_img/include/correlation.hpp"
 #include "../guess_img/include/correlation_s.hpp"
 #include "common.hpp"
+#include "cost_table.hpp"
+#include "event_log.hpp"
+#include "guess_cache.hpp"
+#include "trace.hpp"
 #include "interactive_guess.hpp"
+#include "journal.hpp"
+#include "thread_pool.hpp"
 
 
 namespace procon { namespace modify {
@@ -26,14 +35,15 @@ namespace procon { namespace modify {
 void onRegionSelected(Parameter& param, Index2D const & idx1, Index2D const & idx2)
 {
     for(auto r = idx1[0]; r <= idx2[0]; ++r)
-        for (auto c = idx1[1]; c <= idx2[1]; ++c){
-            if (param.tileState[r][c].isFree())
-                param.tileState[r][c].setGroup(0);
-            else if(param.tileState[r][c].isGrouped())
-                param.tileState[r][c].setFixed();
-            else
-                param.tileState[r][c].reset();
-        }
+        for (auto c = idx1[1]; c <= idx2[1]; ++c)
+            param.modify_state(r, c, [](TileState& st){
+                if (st.isFree())
+                    st.setGroup(0);
+                else if(st.isGrouped())
+                    st.setFixed();
+                else
+                    st.reset();
+            });
 }
 
 
@@ -41,8 +51,8 @@ void onRegionSelectedByRight(Parameter& param, Index2D const & idx1, Index2D con
 {
     for(auto r = idx1[0]; r <= idx2[0]; ++r)
         for (auto c = idx1[1]; c <= idx2[1]; ++c)
-            if(!param.tileState[r][c].isFixed())
-                param.tileState[r][c].setFixed();
+            if(!param.state(r, c).isFixed())
+                param.modify_state(r, c, [](TileState& st){ st.setFixed(); });
 }
 
 
@@ -51,10 +61,12 @@ void onLeftDoubleClick(Parameter& param, Index2D const & idx1)
     const auto r = idx1[0],
                c = idx1[1];
 
-    if (param.tileState[r][c].isFixed())
-        param.tileState[r][c].reset();
-    else
-        param.tileState[r][c].setFixed();
+    param.modify_state(r, c, [](TileState& st){
+        if (st.isFixed())
+            st.reset();
+        else
+            st.setFixed();
+    });
 }
 
 
@@ -67,34 +79,41 @@ void onSelect2Tile(Parameter& param, Index2D const & idx1, Index2D const & idx2)
 void onRightClickEdge(Parameter& param, Index2D const & idx1)
 {
     auto& img = param.swpImage;
-    bool isRow = true;
-    auto ir = utils::iota(0, 0, 1);
-    ptrdiff_t di = 0;
-
-    if(idx1[0] == 0 || idx1[1] == 0){
-        isRow = idx1[0] == 0;
-        ir = utils::iota(0, (isRow ? img.div_y() : img.div_x()) - 1, +1);
-        di = +1;
-    }
-    else if(idx1[0] == img.div_y() -1 || idx1[1] == img.div_x() - 1){
-        isRow = idx1[0] == img.div_y() - 1;
-        ir = utils::iota((isRow ? img.div_y() : img.div_x()) - 1, 0, -1);
-        di = -1;
-    }else
-        PROCON_ENFORCE(false, "logic error");
 
-    for(auto i: ir)
-        for(auto j: utils::iota(isRow ? img.div_x() : img.div_y())){
-            if(isRow) param.swap_element(utils::makeIndex2D(i, j), utils::makeIndex2D(i+di, j));
-            else      param.swap_element(utils::makeIndex2D(j, i), utils::makeIndex2D(j, i + di));
-        }
+    if(idx1[0] == 0 || idx1[1] == 0)
+        param.shift(idx1[0] == 0, true);
+    else if(idx1[0] == img.div_y() -1 || idx1[1] == img.div_x() - 1)
+        param.shift(idx1[0] == img.div_y() - 1, false);
+    else
+        PROCON_ENFORCE(false, "logic error");
 }
 
 
-// マウス操作のコールバック
-void Mouse(int event, int x, int y, int flags, void* param_) // コールバック関数
+// process_mouseの内訳の時間(ミリ秒)
+struct MouseTimings
+{
+    double matching;    // コマンド列の照合
+    double update;      // 照合したコマンドによる並びと状態の更新
+};
+
+
+/** マウスイベントを一つ受け取り、コマンド列を照合して画像を更新します。
+描画は行いません。timingsがあれば、かかった時間の内訳を書き込みます。
+*/
+void process_mouse(Parameter& param, int event, int x, int y, MouseTimings* timings = nullptr)
 {
-    auto& param = *static_cast<Parameter*>(param_);
+    PROCON_TRACE_SCOPE("process_mouse");
+    using Clock = std::chrono::steady_clock;
+    const auto start = Clock::now();
+    Clock::duration updateTime(0);
+
+    // 照合したコマンドの処理を、updateの時間として計る
+    auto update = [&](auto f){
+        const auto t = Clock::now();
+        f();
+        updateTime += Clock::now() - t;
+    };
+
     auto& evSq = param.mouseEvSq;
     auto& img = param.swpImage;
     
@@ -115,6 +134,7 @@ void Mouse(int event, int x, int y, int flags, void* param_) // コールバッ
     }
 
     //utils::writefln("cmd size: %, cmds : %", evSq.size(), evSq);
+    PROCON_TRACE_VALUE("event queue", evSq.size());
 
     auto consumeN = [&](size_t n){
         for(size_t i = 0; i < n; ++i)
@@ -129,15 +149,16 @@ void Mouse(int event, int x, int y, int flags, void* param_) // コールバッ
 
         auto m1 = matchLeftDrag(evSq.begin(), evSq.end());
         if(m1){
-            param.save();
-
             auto idx1 = evSq[0].index,
                  idx2 = evSq[1].index;
 
             if(idx1[0] > idx2[0]) std::swap(idx1[0], idx2[0]);
             if(idx1[1] > idx2[1]) std::swap(idx1[1], idx2[1]);
 
-            onRegionSelected(param, idx1, idx2);
+            update([&]{
+                param.save();
+                onRegionSelected(param, idx1, idx2);
+            });
             consumeN(m1.length);
             continue;
         }else
@@ -146,10 +167,12 @@ void Mouse(int event, int x, int y, int flags, void* param_) // コールバッ
 
         MatchingResult m2 = matchLeftDoubleClick(evSq.begin(), evSq.end());
         if(m2){
-            param.save();
             const auto idx1 = evSq[0].index;
 
-            onLeftDoubleClick(param, idx1);
+            update([&]{
+                param.save();
+                onLeftDoubleClick(param, idx1);
+            });
             consumeN(m2.length);
             continue;
         }else
@@ -169,11 +192,13 @@ void Mouse(int event, int x, int y, int flags, void* param_) // コールバッ
         }(evSq.begin(), evSq.end());
 
         if(m3){
-            param.save();
             const auto idx1 = evSq[0].index,
                        idx2 = evSq[2].index;
 
-            onSelect2Tile(param, idx1, idx2);
+            update([&]{
+                param.save();
+                onSelect2Tile(param, idx1, idx2);
+            });
             consumeN(m3.length);
             continue;
         }
@@ -186,8 +211,10 @@ void Mouse(int event, int x, int y, int flags, void* param_) // コールバッ
             auto idx1 = evSq[0].index;
 
             if(idx1[0] == 0 || idx1[1] == 0 || idx1[0] == img.div_y() - 1 || idx1[1] == img.div_x() - 1){
-                param.save();
-                onRightClickEdge(param, idx1);
+                update([&]{
+                    param.save();
+                    onRightClickEdge(param, idx1);
+                });
                 consumeN(m4.length);
                 continue;
             }
@@ -198,15 +225,16 @@ void Mouse(int event, int x, int y, int flags, void* param_) // コールバッ
 
         auto m5 = matchRightDrag(evSq.begin(), evSq.end());
         if(m5){
-            param.save();
-
             auto idx1 = evSq[0].index,
                  idx2 = evSq[1].index;
 
             if(idx1[0] > idx2[0]) std::swap(idx1[0], idx2[0]);
             if(idx1[1] > idx2[1]) std::swap(idx1[1], idx2[1]);
 
-            onRegionSelectedByRight(param, idx1, idx2);
+            update([&]{
+                param.save();
+                onRegionSelectedByRight(param, idx1, idx2);
+            });
             consumeN(m5.length);
             continue;
         }
@@ -220,84 +248,553 @@ void Mouse(int event, int x, int y, int flags, void* param_) // コールバッ
             break;
     }
 
-    cv::imshow(param.windowName, param.cvMat());
+    if(timings){
+        auto ms = [](Clock::duration d){ return std::chrono::duration<double, std::milli>(d).count(); };
+        timings->update = ms(updateTime);
+        timings->matching = ms(Clock::now() - start - updateTime);
+    }
 }
 
 
-/**
-エンターを押せば、callbackが別スレッドで起動します
+// Mouseに渡す引数
+struct MouseContext
+{
+    Parameter* param;
+    EventRecorder* recorder;    // 記録しない場合はnullptr
+    bool deferDraw;             // 描画をメインループに任せるかどうか
+};
+
+
+// マウス操作のコールバック
+void Mouse(int event, int x, int y, int flags, void* context) // コールバック関数
+{
+    // コマンドになるのはボタンの上げ下げだけなので、移動などは記録も処理もしない
+    switch(event){
+      case CV_EVENT_LBUTTONUP:
+      case CV_EVENT_LBUTTONDOWN:
+      case CV_EVENT_RBUTTONUP:
+      case CV_EVENT_RBUTTONDOWN:
+        break;
+
+      default:
+        return;
+    }
+
+    auto& ctx = *static_cast<MouseContext*>(context);
+    if(ctx.recorder)
+        ctx.recorder->mouse(event, x, y, flags);
+
+    process_mouse(*ctx.param, event, x, y);
+
+    // メインループが一定間隔で起きている間は、続けて来たイベントをまとめて次のループで描画する。
+    // キー入力を待って止まっている間はここで描画する
+    if(!ctx.deferDraw && ctx.param->is_dirty())
+        cv::imshow(ctx.param->windowName, ctx.param->cvMat());
+}
+
+
+// modify_guess_imageで使うキー
+namespace keys
+{
+    constexpr int enter10 = 10,
+                  enter13 = 13,
+                  esc = 27,
+                  space = 32,
+                  key_z = 97 + 'z' - 'a',
+                  key_y = 97 + 'y' - 'a',
+                  key_c = 97 + 'c' - 'a',
+                  key_h = 97 + 'h' - 'a',
+                  key_x = 97 + 'x' - 'a',
+                  key_b = 97 + 'b' - 'a',
+                  key_p = 97 + 'p' - 'a',
+                  key_n = 97 + 'n' - 'a',
+                  tab = 9;
+}
+
+
+/** 画像の編集だけで完結するキー(z, y, h, c)を処理します。
+処理したキーならtrueを返します。
+*/
+bool handle_edit_key(Parameter& param, int key)
+{
+    switch(key){
+      case keys::key_z:
+        param.restore();
+        return true;
+
+      case keys::key_y:
+        param.redo();
+        return true;
+
+      case keys::key_h:
+        param.toggle_heat();
+        return true;
+
+      case keys::key_c:
+        param.mouseEvSq.clear();
+        param.save();
+        utils::DividedImage::foreach(param.swpImage, [&](size_t i, size_t j){
+            if(!param.state(i, j).isFree())
+                param.modify_state(i, j, [](TileState& st){ st.reset(); });
+        });
+        return true;
+
+      default:
+        return false;
+    }
+}
+
+
+/** 推定結果を一回の操作として反映し、グループ(青)を元に戻します。
+推定を始めたときのrevisionから画像が変更されていれば、古い状態に対する結果なので反映せずにfalseを返します。
+分割数と大きさの合わない結果(配置が見つからなかったときの空の結果など)も反映せずにfalseを返します。
 */
+bool apply_guess_result(Parameter& param, ImgMap const & v, std::size_t revision)
+{
+    if(param.revision() != revision)
+        return false;
+
+    if(v.rows() != param.swpImage.div_y() || v.cols() != param.swpImage.div_x())
+        return false;
+
+    param.save();
+    param.apply_index(v);
+
+    utils::DividedImage::foreach(param.swpImage, [&](size_t i, size_t j){
+        if(param.state(i, j).isGrouped())
+            param.modify_state(i, j, [](TileState& st){ st.reset(); });
+    });
+
+    return true;
+}
+
+
+/** 推定結果の候補を反映し、反映した後に画像が変更されるまでは、ほかの候補へ切り替えられるようにします
+*/
+class CandidateSwitcher
+{
+  public:
+    CandidateSwitcher() : _cands(), _current(0), _revision(0) {}
+
+
+    /** 最初の候補を反映します。
+    apply_guess_resultと同じく、revisionから画像が変更されていれば反映せずにfalseを返します。
+    分割数と大きさの合わない候補は、切り替えの対象からも除きます。
+    */
+    bool apply(Parameter& param, std::vector<GuessCandidate> cands, std::size_t revision)
+    {
+        _cands.clear();
+        cands.erase(std::remove_if(cands.begin(), cands.end(), [&](GuessCandidate const & c){
+            return c.index.rows() != param.swpImage.div_y() || c.index.cols() != param.swpImage.div_x();
+        }), cands.end());
+
+        if(cands.empty() || !apply_guess_result(param, cands.front().index, revision))
+            return false;
+
+        _cands = std::move(cands);
+        _current = 0;
+        _revision = param.revision();
+        return true;
+    }
+
+
+    /** 反映した候補を取り消して、次の候補を反映します。切り替えられなければfalseを返します
+    */
+    bool next(Parameter& param)
+    {
+        if(!active(param))
+            return false;
+
+        param.restore();
+        _current = (_current + 1) % _cands.size();
+        apply_guess_result(param, _cands[_current].index, param.revision());
+        _revision = param.revision();
+        return true;
+    }
+
+
+    bool active(Parameter const & param) const { return _cands.size() > 1 && param.revision() == _revision; }
+
+
+    /** 各候補の名前と評価値。反映している候補を[]で囲みます
+    */
+    std::string status(Parameter const & param) const
+    {
+        if(!active(param))
+            return "";
+
+        std::string str;
+        for(std::size_t k = 0; k < _cands.size(); ++k){
+            const auto s = utils::format("% %", _cands[k].name, _cands[k].score);
+            str += (k ? " " : "") + (k == _current ? "[" + s + "]" : s);
+        }
+
+        return str + "  n: next";
+    }
+
+
+  private:
+    std::vector<GuessCandidate> _cands;
+    std::size_t _current;
+    std::size_t _revision;      // 候補を反映した直後のParameter::revision
+};
+
+
+namespace modify_detail {
+
+// modify_guess_imageの本体。返るときには、表を作るスレッド、後段の処理のスレッド、推定のスレッドはすべて終わっている
 template <typename Task>
-std::vector<std::vector<utils::ImageID>> modify_guess_image(std::vector<std::vector<utils::ImageID>> const & before, utils::Problem const & pb, Task callback)
+std::vector<std::vector<utils::ImageID>> edit_session(std::vector<std::vector<utils::ImageID>> const & before, utils::Problem const & pb, Task callback,
+                                                      char const * recordPath, guess::Correlator const * correlator,
+                                                      char const * journalPath)
 {
     const auto windowName = "Modify Guess Image";
 
-    std::unique_ptr<Parameter> param(new Parameter(pb.dividedImage().clone(), before, windowName));
+    std::unique_ptr<Parameter> param(new Parameter(pb.dividedImage(), before, windowName));
+
+    // 評価関数の表はまだ無いので、操作を再現するのは並びと状態の書き換えだけで済む
+    std::unique_ptr<SessionJournal> journal;
+    if(journalPath){
+        auto resumed = SessionJournal::read(journalPath, before);
+        if(resumed){
+            if(const auto n = resume_session(*param, before, *resumed))
+                utils::writeln("resumed the session journal (" + std::to_string(*n) + " records replayed)");
+            else{
+                // 再現できない記録は使わずに退避し、元画像はそのまま使って初めからやり直す
+                utils::writeln("the session journal does not reproduce its checkpoints; starting a new session");
+                param.reset(new Parameter(param->swpImage.atlas(), before, windowName));
+                resumed = boost::none;
+            }
+        }
+
+        journal.reset(new SessionJournal(journalPath, before, resumed.get_ptr()));
+        param->set_observer(journal.get());
+    }
 
-    std::vector<std::future<void>> sendingThreads;
-    // boost::optional<std::shared_future<std::vector<std::vector<utils::Index2D>>>> guessThread = boost::none;
+    std::unique_ptr<EventRecorder> recorder;
+    if(recordPath)
+        recorder.reset(new EventRecorder(recordPath, before));
+
+    MouseContext mouseContext = {param.get(), recorder.get(), false};
+
+    // 後段の処理は、決まった数のスレッドで順に行う
+    constexpr std::size_t sendingWorkers = 2,
+                          sendingCapacity = 8;
+    BoundedJobPool<ImgMap> sendingPool(sendingWorkers, sendingCapacity);
+    std::string sendingMessage;
+    std::string guessMessage;
+    bool tablesReady = false;       // 評価関数の表がすべて出来上がったか
+    int pendingGuess = -1;          // 表が出来上がるのを待っている推定のキー。なければ-1
+
+    // 推定の内側では同じ断片の組が何度も評価されるので、評価値を表にしておく。
+    // 表は別スレッドで作り、その間もウィンドウは操作できる。
+    // 出来上がる前に押された推定のキーは覚えておき、出来上がってから推定を始める(pendingGuess)
+    // UIのスレッドの分を空けて、残りを二つの表で分ける
+    const std::size_t tableThreads = std::max<std::size_t>(std::thread::hardware_concurrency() / 2, 1);
+    const LazyCostTable pred_guess = correlator
+        ? LazyCostTable(before, [correlator](){ return std::cref(*correlator); }, tableThreads)
+        : LazyCostTable(before, [&pb](){ return guess::Correlator(pb); }, tableThreads);
+    const LazyCostTable pred_s(before, [&pb](){ return guess_s::Correlator(pb); }, tableThreads);
+
+    // 同じ状態で推定し直したときに探索の末端の評価を使い回すための表。評価関数ごとに持つ
+    constexpr std::size_t ttBytes = 64 << 20;
+    TranspositionTable tt_guess(ttBytes), tt_s(ttBytes);
+
+    // pキーで同時に推定する評価関数。候補は状態表示欄と同じpred_guessの評価値で比べる。
+    // 表が出来上がってから、最初にpキーが押されたときに作る
+    std::vector<PortfolioEntry> portfolio;
+
+    // 実行中の推定と、その進み具合、推定を始めたときのParameter::revision、使っている表、入力。
+    // guessSpeculativeがtrueなら、操作が止まっている間の先読みで、結果は反映せずにguessCacheに入れるだけ
+    std::unique_ptr<GuessProgress> guessProgress;
+    std::future<std::vector<GuessCandidate>> guessThread;
+    std::size_t guessRevision = 0;
+    TranspositionTable const * guessTT = nullptr;
+    GuessKey guessKey = {ImgMap(), Grid<TileState>(), nullptr, SearchMode::branchAndBound};
+    bool guessSpeculative = false;
+
+    // 推定のスレッドは上の表と進み具合を参照で読むので、例外で抜けるときも、止めて待ってからそれらを破棄する
+    struct GuessJoiner
+    {
+        std::unique_ptr<GuessProgress>& progress;
+        std::future<std::vector<GuessCandidate>>& thread;
+
+        ~GuessJoiner()
+        {
+            if(thread.valid()){
+                progress->cancel();
+                thread.wait();
+            }
+        }
+    } guessJoiner = {guessProgress, guessThread};
+
+    // 時間を区切るビームサーチの結果は入れない
+    constexpr std::size_t guessCacheSize = 32;
+    GuessCache guessCache(guessCacheSize);
+    CandidateSwitcher switcher;
 
     cv::namedWindow(windowName, CV_WINDOW_AUTOSIZE);
     cv::imshow(windowName, param->cvMat());
-    cv::setMouseCallback(windowName, Mouse, param.get());
+    cv::setMouseCallback(windowName, Mouse, &mouseContext);
 
-    // 後続するスレッドを新たに作る
+    // 後段の処理を投入する。同じ並びが待っているか実行中なら投入しない
     auto spawnNewThread = [&](){
-        sendingThreads.emplace_back(std::async(
+        const ImgMap index = param->swpImage.get_index();
+        if(journal)
+            journal->checkpoint(*param);
+
+        switch(sendingPool.submit(index, [callback, nested = index.to_nested()](){ callback(nested); })){
+          case BoundedJobPool<ImgMap>::Submitted::accepted:
+            sendingMessage = "";
+            break;
+
+          case BoundedJobPool<ImgMap>::Submitted::duplicate:
+            sendingMessage = "already sent";
+            break;
+
+          case BoundedJobPool<ImgMap>::Submitted::full:
+            sendingMessage = "send queue is full";
+            break;
+        }
+    };
+
+
+    auto currentGuessKey = [&](CostTable const & table, SearchMode mode){
+        return GuessKey{param->swpImage.get_index(), param->states(), &table, mode};
+    };
+
+
+    // keyのスナップショットから、別スレッドで画像推定を始める。
+    // portfolioがあれば、その評価関数すべてで推定し、key.tableでの評価値の良い順に候補を返す
+    auto startGuess = [&](GuessKey const & key, TranspositionTable& tt, bool speculative, std::vector<PortfolioEntry> const * portfolio){
+        guessProgress.reset(new GuessProgress());
+        guessRevision = param->revision();
+        guessTT = &tt;
+        guessKey = key;
+        guessSpeculative = speculative;
+
+        GuessOption opt;
+        opt.mode = key.mode;
+        opt.progress = guessProgress.get();
+        opt.tt = &tt;
+        opt.refine = true;
+
+        // 先読みの間も操作や描画が滞らないよう、スレッドを一つ空けておく
+        if(speculative)
+            opt.threads = std::max<std::size_t>(opt.threads, 2) - 1;
+
+        CostTable const & table = *key.table;
+        guessThread = std::async(
             std::launch::async,
-            callback,
-            param->swpImage.get_index()));
+            [&table, &pb, opt, portfolio](ImgMap const & index, Grid<TileState> const & states){
+                if(portfolio)
+                    return portfolio_guess(index, states, pb, *portfolio, table, opt);
+
+                return std::vector<GuessCandidate>(1, GuessCandidate{"", &table, interactive_guess(index, states, pb, table, opt), 0});
+            },
+            key.index,
+            key.states);
+    };
+
+
+    // 先読みを止め、結果を捨てる
+    auto dropSpeculation = [&](){
+        if(!guessThread.valid() || !guessSpeculative)
+            return;
+
+        guessProgress->cancel();
+        guessThread.wait();
+        guessThread = std::future<std::vector<GuessCandidate>>();
+    };
+
+
+    // 現在の並びと状態から画像を推定する。
+    // 同じ入力の結果を覚えていればすぐに反映し、その入力を先読みしていればそれを待つ
+    auto doInteractiveGuess = [&](CostTable const & table, TranspositionTable& tt, SearchMode mode){
+        auto key = currentGuessKey(table, mode);
+        if(mode != SearchMode::beam)
+            if(auto cached = guessCache.find(key)){
+                dropSpeculation();
+
+                const bool applied = switcher.apply(*param, std::vector<GuessCandidate>(1, GuessCandidate{"", &table, *cached, 0}), param->revision());
+                if(recorder)
+                    recorder->guess(applied);
+
+                guessMessage = "guess: cached";
+                return;
+            }
+
+        if(guessThread.valid() && guessKey == key){
+            // 先読みを本当の推定に切り替える。並びと状態は同じなので、今のrevisionに対して反映してよい
+            guessSpeculative = false;
+            guessRevision = param->revision();
+            return;
+        }
+
+        dropSpeculation();
+        startGuess(key, tt, false, nullptr);
+    };
+
+
+    // entriesのすべての評価関数で同時に推定し、scorerでの評価値が最も良いものを反映する。
+    // 残りの候補へはnキーで切り替える
+    auto doPortfolioGuess = [&](std::vector<PortfolioEntry> const & entries, CostTable const & scorer, TranspositionTable& tt){
+        dropSpeculation();
+        startGuess(currentGuessKey(scorer, SearchMode::branchAndBound), tt, false, &entries);
     };
 
 
-    // 画像推定を行う
-    auto doInteractiveGuess = [&param, &pb](const auto& pred){
+    // 推定が終わっていれば結果を反映し、終わっていなければ進み具合を表示する
+    auto arrangeGuess = [&](){
+        if(!guessThread.valid())
+            return;
+
+        if(guessThread.wait_for(std::chrono::milliseconds(0)) != std::future_status::ready){
+            guessMessage = guessSpeculative ? std::string("precomputing guess...")
+                : guessProgress->cancelled() ? std::string("cancelling guess...")
+                : utils::format("guessing... % placements, best %, cache hit % / %",
+                                guessProgress->explored(), guessProgress->best(), guessTT->stats().hits, guessTT->stats().lookups);
+            return;
+        }
+
+        guessMessage = "";
         utils::collectException<std::runtime_error>([&](){
-            return interactive_guess(*param, pb, pred);
+            return guessThread.get();
         })
-        .onSuccess([&](std::vector<std::vector<utils::ImageID>>&& v){
-            param->save();
-            param->swpImage = utils::SwappedImage(param->swpImage.dividedImage(), v);
+        .onSuccess([&](std::vector<GuessCandidate>&& cands){
+            if(guessKey.mode != SearchMode::beam)
+                for(auto& c: cands)
+                    guessCache.store(GuessKey{guessKey.index, guessKey.states, c.table, guessKey.mode}, c.index);
 
-            utils::DividedImage::foreach(param->swpImage, [&](size_t i, size_t j){
-                if(param->tileState[i][j].isGrouped())
-                    param->tileState[i][j].reset();
-            });
+            if(guessSpeculative)
+                return;
+
+            const bool applied = switcher.apply(*param, std::move(cands), guessRevision);
+            if(recorder)
+                recorder->guess(applied);
+
+            if(!applied)
+                guessMessage = "guess discarded: image was modified";
         })
-        .onFailure([](std::runtime_error& ex){ utils::writeln(ex); });
+        .onFailure([&](std::runtime_error& ex){
+            if(guessSpeculative)
+                return;
+
+            utils::writeln(ex);
+            guessMessage = ex.what();
+        });
     };
 
 
-    // 後続するスレッドの状態を監視する
-    auto arrangeThreads = [&](){
-        std::vector<std::future<void>> newths;
-        std::chrono::milliseconds span(0);  // 待たない
+    // 推定と後段の処理の状態を、状態表示欄にまとめる。
+    // 推定か後段の処理が動いていればtrueを返す
+    auto updateStatus = [&]() -> bool {
+        std::string str = guessMessage;
+        auto append = [&](std::string const & s){
+            if(!s.empty()) str += (str.empty() ? "" : "  ") + s;
+        };
 
-        for(auto& e: sendingThreads){
-            auto state = e.wait_for(span);
+        const std::size_t nQueued = sendingPool.queued(),
+                          nRunning = sendingPool.running(),
+                          nFinished = sendingPool.finished(),
+                          nFailed = sendingPool.failed();
+        if(nQueued + nRunning + nFinished != 0)
+            append(utils::format("send: % queued, % running, % failed, last %s", nQueued, nRunning, nFailed, sendingPool.last_latency()));
 
-            if(state != std::future_status::ready)
-                newths.emplace_back(std::move(e));
-        }
-        sendingThreads = std::move(newths);
+        append(switcher.status(*param));
+        if(!tablesReady)
+            append("preparing predictors...");
+        if(journal && !journal->good())
+            append("journal write failed");
+
+        append(sendingMessage);
+        param->set_status(str);
+
+        return guessThread.valid() || nQueued + nRunning != 0 || !tablesReady;
     };
 
 
-    constexpr int enter10 = 10,
-                  enter13 = 13,
-                  esc = 27,
-                  space = 32,
-                  key_z = 97 + 'z' - 'a',
-                  key_c = 97 + 'c' - 'a',
-                  tab = 9;
+    using namespace keys;
+
+    // 推定のキー(space, b, tab, p)を処理する。表が出来上がってから呼ぶこと。
+    // 推定が実行中なら何もしない。推定を始めるときは、再生できるようにその時点のrevisionを記録する
+    auto runGuessKey = [&](int key){
+        if(guessThread.valid() && !guessSpeculative){
+            utils::writeln("now running a guess thread");
+            return;
+        }
+
+        if(recorder)
+            recorder->guess_started(key, param->revision());
+
+        switch(key){
+          case space:
+            doInteractiveGuess(pred_guess.get(), tt_guess, SearchMode::branchAndBound);
+            break;
+
+          case key_b:
+            // グループが多くて時間がかかるときのための、時間を区切った推定
+            doInteractiveGuess(pred_guess.get(), tt_guess, SearchMode::beam);
+            break;
+
+          case tab:
+            doInteractiveGuess(pred_s.get(), tt_s, SearchMode::branchAndBound);
+            break;
 
-    auto pred_guess = guess::Correlator(pb);
-    auto pred_s = guess_s::Correlator(pb);
+          case key_p:
+            if(portfolio.empty())
+                portfolio = {
+                    {"guess", &pred_guess.get(), &tt_guess},
+                    {"s", &pred_s.get(), &tt_s},
+                };
 
+            doPortfolioGuess(portfolio, pred_guess.get(), tt_guess);
+            break;
+
+          default:
+            break;
+        }
+    };
+
+    // 推定や後段の処理が動いている間は、その完了や進み具合を表示するために一定間隔で起きる。
+    // HighGUIのイベントループには別スレッドから起こす手段がないので、ポーリングで代える
+    constexpr int busyWait = 16;
+
+    // 操作が止まってからこの時間(ミリ秒)がたてば、spaceで行う推定を先読みしておく
+    constexpr int idleWait = 300;
+
+    // 何も動いていなくても、idleWaitごとに起きる。
+    // マウスによる変更はMouseで行われ、waitKeyを返させないので、起きたときにrevisionを見て先読みをやり直す
+    bool busy = false;
+    bool speculated = false;
+    std::size_t seenRevision = param->revision();
+    auto lastChange = std::chrono::steady_clock::now();
     while(1){
-        const int key = cv::waitKey(100);
+        const int key = cv::waitKey(busy ? busyWait : idleWait);
+        if(recorder && key != -1)
+            recorder->key(key);
+
+        // 並びか状態が変わったら、古い状態の先読みは止める
+        if(param->revision() != seenRevision){
+            seenRevision = param->revision();
+            lastChange = std::chrono::steady_clock::now();
+            speculated = false;
+            dropSpeculation();
+        }
 
-        arrangeThreads();
+        // 手修正の良し悪しがすぐ分かるよう、表が出来上がったら評価値を表示する
+        if(!tablesReady && pred_guess.ready() && pred_s.ready()){
+            param->set_scorer(pred_guess.get());
+            tablesReady = true;
+
+            if(pendingGuess != -1){
+                guessMessage = "";
+                runGuessKey(pendingGuess);
+                pendingGuess = -1;
+            }
+        }
+
+        arrangeGuess();
         switch(key){
           case enter10:
           case enter13:
@@ -305,39 +802,91 @@ std::vector<std::vector<utils::ImageID>> modify_guess_image(std::vector<std::vec
             break;
 
           case esc:
+            if(guessThread.valid()){
+                guessProgress->cancel();
+                guessThread.wait();
+            }
             goto Lreturn;
 
           case space:
-            // if(!guessThread)
-                doInteractiveGuess(pred_guess);
-            // else
-                // utils::writeln("now running a guess thread");
+          case key_b:
+          case tab:
+          case key_p:
+            // 表を待つ間にUIが止まらないよう、ここでは表を引かない
+            if(tablesReady)
+                runGuessKey(key);
+            else{
+                pendingGuess = key;
+                guessMessage = "guess will start when the predictors are ready";
+            }
             break;
 
-          case key_z:
-            param->restore();
+          case key_x:
+            if(guessThread.valid())
+                guessProgress->cancel();
+
+            if(pendingGuess != -1){
+                pendingGuess = -1;
+                guessMessage = "";
+            }
             break;
 
-          case key_c:
-            param->mouseEvSq.clear();
-            param->save();
-            utils::DividedImage::foreach(param->swpImage, [&](size_t i, size_t j){
-                param->tileState[i][j].reset();
-            });
+          case key_n:
+            switcher.next(*param);
             break;
 
-          case tab:
-            doInteractiveGuess(pred_s);
+          default:
+            handle_edit_key(*param, key);
+        }
+
+        if(key == -1 && tablesReady && !speculated && !guessThread.valid()
+        && std::chrono::steady_clock::now() - lastChange >= std::chrono::milliseconds(idleWait)){
+            speculated = true;
 
-          default: {}
+            auto k = currentGuessKey(pred_guess.get(), SearchMode::branchAndBound);
+            if(!guessCache.contains(k))
+                startGuess(k, tt_guess, true, nullptr);
         }
 
-        cv::imshow(windowName, param->cvMat());
+        if(journal && journal->wants_checkpoint())
+            journal->checkpoint(*param);
+
+        busy = updateStatus();
+        mouseContext.deferDraw = busy;
+        if(param->is_dirty())
+            cv::imshow(windowName, param->cvMat());
     }
 
   Lreturn:
+    if(journal){
+        journal->checkpoint(*param);
+        param->set_observer(nullptr);
+    }
+
     cv::destroyWindow(windowName);
-    return param->swpImage.get_index();
+    return param->swpImage.get_index().to_nested();
+}
+
+} // namespace modify_detail
+
+
+/**
+エンターを押せば、callbackが別スレッドで起動します。
+recordPathを与えると、マウスとキーの操作をそのファイルに記録します(replay.cppで再生できます)。
+correlatorを与えると、guess::Correlator(pb)を作り直さずにそれを使います。modify_guess_imageが返るまで生存している必要があります。
+journalPathを与えると、並びと状態と履歴の変化をそのファイルに書き出し続けます。
+同じbeforeから始めた記録が既にあれば、その続きから再開します(SessionJournal)。
+*/
+template <typename Task>
+std::vector<std::vector<utils::ImageID>> modify_guess_image(std::vector<std::vector<utils::ImageID>> const & before, utils::Problem const & pb, Task callback,
+                                                            char const * recordPath = nullptr, guess::Correlator const * correlator = nullptr,
+                                                            char const * journalPath = nullptr)
+{
+    auto after = modify_detail::edit_session(before, pb, callback, recordPath, correlator, journalPath);
+
+    // 計測の記録は書き出し中に追記されてはいけないので、記録するスレッドがすべて終わってから書き出す
+    PROCON_TRACE_EXPORT(PROCON_MODIFY_TRACE_FILE);
+    return after;
 }
 
 }}
\ No newline at end of file
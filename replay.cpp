@@ -0,0 +1,73 @@
+
+//インクルードファイル指定
+#include <opencv2/opencv.hpp>
+#include <algorithm>
+#include <memory>
+
+#include "../inout/include/inout.hpp"
+#include "../utils/include/types.hpp"
+#include "../utils/include/image.hpp"
+#include "../utils/include/range.hpp"
+#include "../guess_img/include/guess.hpp"
+#include "../guess_img/include/blocked_guess.hpp"
+#include "../guess_img/include/correlation.hpp"
+#include "../utils/include/backtrace.hpp"
+#include "replay.hpp"
+#include "trace.hpp"
+
+using namespace procon;
+
+
+// test.cppで記録した操作を、ウィンドウを開かずに再生して時間を計る
+// 使い方: ./replay <問題番号> <記録ファイル>
+int main(int argc, char* argv[])
+{
+    if(argc < 3){
+        utils::writeln("usage: replay <problem id> <event log>");
+        return 1;
+    }
+
+    const size_t pId = std::stoul(argv[1]);
+
+    auto p_opt = utils::Problem::get(utils::format("img%.ppm", pId));
+
+    if(!p_opt)
+        p_opt = inout::get_problem_from_test_server(pId);
+
+    if(!p_opt){
+        utils::writeln("cannot get the problem");
+        return 1;
+    }
+
+    auto& pb = *p_opt;
+
+    // 記録したときと同じ初期の並びを作る
+    auto pred = guess::Correlator(pb);
+    auto idxs = blocked_guess::guess(pb, pred);
+
+    auto log = modify::EventLog::read(argv[2]);
+    auto steps = modify::replay_event_log(log, idxs, pb);
+
+    // 一行に一イベントのCSV
+    utils::writeln("time,kind,matching_ms,update_ms,compose_ms");
+    double sum[3] = {}, max[3] = {};
+    for(auto& s: steps){
+        utils::writefln("%,%,%,%,%", s.event.time, static_cast<char>(s.event.kind), s.matching, s.update, s.compose);
+
+        const double v[3] = {s.matching, s.update, s.compose};
+        for(int k = 0; k < 3; ++k){
+            sum[k] += v[k];
+            max[k] = std::max(max[k], v[k]);
+        }
+    }
+
+    const size_t n = std::max<size_t>(steps.size(), 1);
+    utils::writefln("# events: %", steps.size());
+    utils::writefln("# matching: mean % ms, max % ms", sum[0] / n, max[0]);
+    utils::writefln("# update:   mean % ms, max % ms", sum[1] / n, max[1]);
+    utils::writefln("# compose:  mean % ms, max % ms", sum[2] / n, max[2]);
+
+    PROCON_TRACE_EXPORT("replay_trace.json");
+
+    return 0;
+}
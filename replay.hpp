@@ -0,0 +1,130 @@
+#pragma once
+
+#include <chrono>
+#include <vector>
+#include <boost/optional.hpp>
+
+#include "../utils/include/types.hpp"
+#include "../utils/include/image.hpp"
+#include "../utils/include/exception.hpp"
+#include "../utils/include/dwrite.hpp"
+#include "../guess_img/include/correlation.hpp"
+#include "../guess_img/include/correlation_s.hpp"
+#include "common.hpp"
+#include "cost_table.hpp"
+#include "event_log.hpp"
+#include "interactive_guess.hpp"
+#include "modify_guess_image.hpp"
+
+
+namespace procon { namespace modify {
+
+
+// 再生した一つのイベントにかかった時間(ミリ秒)
+struct ReplayStep
+{
+    LoggedEvent event;
+    double matching;    // マウスのコマンド列の照合
+    double update;      // 並びと状態の更新(推定を含む)
+    double compose;     // cvMatによる表示用画像の合成
+};
+
+
+/** 記録された操作を、ウィンドウを開かずにmodify_guess_imageと同じ手順で再生します。
+推定は、キー入力ではなく推定を始めた記録(s)の時点の並びと状態から同期的に行い、
+結果は記録で反映された時点(g)で反映します。enterで後段へ渡す処理は行いません。
+*/
+std::vector<ReplayStep> replay_event_log(EventLog const & log, std::vector<std::vector<utils::ImageID>> const & before, utils::Problem const & pb)
+{
+    using Clock = std::chrono::steady_clock;
+    auto ms = [](Clock::duration d){ return std::chrono::duration<double, std::milli>(d).count(); };
+
+    PROCON_ENFORCE(log.digest == index_digest(before), "Error: the event log was recorded from another arrangement.");
+
+    Parameter param(pb.dividedImage(), before, "replay");
+
+    const CostTable pred_guess(before, guess::Correlator(pb));
+    const CostTable pred_s(before, guess_s::Correlator(pb));
+    TranspositionTable tt_guess(64 << 20), tt_s(64 << 20);
+    const std::vector<PortfolioEntry> portfolio = {
+        {"guess", &pred_guess, &tt_guess},
+        {"s", &pred_s, &tt_s},
+    };
+    param.set_scorer(pred_guess);
+    param.cvMat();
+
+    boost::optional<std::vector<GuessCandidate>> guessResult;
+    CandidateSwitcher switcher;
+    std::size_t guessRevision = 0;
+
+    std::vector<ReplayStep> steps;
+    for(auto& ev: log.events){
+        ReplayStep step = {ev, 0, 0, 0};
+
+        if(ev.kind == LoggedEvent::Kind::mouse){
+            MouseTimings t;
+            process_mouse(param, ev.event, ev.x, ev.y, &t);
+            step.matching = t.matching;
+            step.update = t.update;
+        }
+        else{
+            const auto t = Clock::now();
+
+            if(ev.kind == LoggedEvent::Kind::guess){
+                if(!guessResult || switcher.apply(param, *guessResult, guessRevision) != ev.applied)
+                    utils::writeln("warning: the guess result was handled differently from the recording");
+
+                guessResult = boost::none;
+            }
+            else if(ev.kind == LoggedEvent::Kind::guessStarted){
+                if(param.revision() != ev.revision)
+                    utils::writeln("warning: the guess was started from a different state than the recording");
+
+                // 中断された推定にはgがないので、前の結果はここで捨てる
+                guessResult = boost::none;
+                guessRevision = param.revision();
+
+                if(ev.key == keys::key_p){
+                    GuessOption opt;
+                    opt.refine = true;
+
+                    guessResult = portfolio_guess(param.swpImage.get_index(), param.states(), pb, portfolio, pred_guess, opt);
+                }
+                else{
+                    GuessOption opt;
+                    opt.tt = ev.key == keys::tab ? &tt_s : &tt_guess;
+                    opt.refine = true;
+                    if(ev.key == keys::key_b)
+                        opt.mode = SearchMode::beam;
+
+                    CostTable const & table = ev.key == keys::tab ? pred_s : pred_guess;
+                    guessResult = std::vector<GuessCandidate>(1, GuessCandidate{"", &table, interactive_guess(param, pb, table, opt), 0});
+                }
+            }
+            else if(ev.key == keys::space || ev.key == keys::tab || ev.key == keys::key_b || ev.key == keys::key_p){
+                // 推定はsの記録で行う。実行中や表の準備中に押されたキーは、推定を始めないことがある
+            }
+            else if(ev.key == keys::key_n)
+                switcher.next(param);
+            else if(ev.key == keys::esc)
+                break;
+            else
+                handle_edit_key(param, ev.key);
+
+            step.update = ms(Clock::now() - t);
+        }
+
+        if(param.is_dirty()){
+            const auto t = Clock::now();
+            param.cvMat();
+            step.compose = ms(Clock::now() - t);
+        }
+
+        steps.push_back(step);
+    }
+
+    return steps;
+}
+
+
+}}
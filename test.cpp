@@ -41,9 +41,12 @@ int main(int argc, char* argv[])
         auto idxs = blocked_guess::guess(pb, pred);
         
         try{
+            // predはmodify_guess_imageでもそのまま使う
+            // 引数にファイル名を与えると、操作をそのファイルに記録する(replay.cppで再生できる)
+            // 修正作業はmodify<問題番号>.journalに書き出し続け、落ちても次に起動したときにその続きから再開する
             auto after = modify::modify_guess_image(idxs, pb, [](std::vector<std::vector<utils::ImageID>> imgMap){
                 utils::writeln("send");
-            });
+            }, argc > 1 ? argv[1] : nullptr, &pred, utils::format("modify%.journal", pId).c_str());
         }
         catch (std::exception& ex){
             utils::writeln(ex);
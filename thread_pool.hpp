@@ -0,0 +1,338 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <iterator>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../utils/include/dwrite.hpp"
+
+
+namespace procon { namespace modify {
+
+
+/** ワークスティーリング方式のスレッドプール
+ワーカ内からsubmitされた仕事は自分のキューの末尾に積まれ、LIFOで処理されます。
+自分のキューが空になったワーカは、他のワーカのキューの先頭から仕事を盗みます。
+*/
+class WorkStealingPool
+{
+  public:
+    explicit WorkStealingPool(std::size_t nThreads)
+    : _queues(), _workers(), _nQueued(0), _nPending(0), _next(0), _stop(false), _error()
+    {
+        if(nThreads == 0)
+            nThreads = 1;
+
+        for(std::size_t i = 0; i < nThreads; ++i)
+            _queues.emplace_back(new Queue());
+
+        for(std::size_t i = 0; i < nThreads; ++i)
+            _workers.emplace_back([this, i](){ run(i); });
+    }
+
+
+    ~WorkStealingPool()
+    {
+        {
+            std::lock_guard<std::mutex> lk(_m);
+            _stop = true;
+        }
+        _cvWork.notify_all();
+
+        for(auto& th: _workers)
+            th.join();
+    }
+
+
+    WorkStealingPool(WorkStealingPool const &) = delete;
+    WorkStealingPool& operator=(WorkStealingPool const &) = delete;
+
+
+    std::size_t size() const { return _workers.size(); }
+
+
+    template <typename F>
+    void submit(F&& f)
+    {
+        auto& cur = current();
+        const std::size_t qi = (cur.pool == this) ? cur.index : (_next++ % _queues.size());
+
+        ++_nPending;
+        {
+            std::lock_guard<std::mutex> lk(_m);
+            ++_nQueued;
+        }
+        {
+            std::lock_guard<std::mutex> lk(_queues[qi]->m);
+            _queues[qi]->tasks.emplace_back(std::forward<F>(f));
+        }
+        _cvWork.notify_one();
+    }
+
+
+    /** 投入された仕事(とそこから投入された仕事)がすべて終わるまで待ちます。
+    仕事が例外を投げた場合は、最初の例外をここで再送出します。
+    */
+    void wait()
+    {
+        std::unique_lock<std::mutex> lk(_m);
+        _cvDone.wait(lk, [&]{ return _nPending == 0; });
+
+        if(_error){
+            auto e = _error;
+            _error = nullptr;
+            std::rethrow_exception(e);
+        }
+    }
+
+
+  private:
+    struct Queue
+    {
+        std::mutex m;
+        std::deque<std::function<void()>> tasks;
+    };
+
+
+    struct Current
+    {
+        WorkStealingPool const * pool;
+        std::size_t index;
+    };
+
+
+    static Current& current()
+    {
+        static thread_local Current cur = {nullptr, 0};
+        return cur;
+    }
+
+
+    bool try_pop(std::size_t i, std::function<void()>& task)
+    {
+        {
+            auto& q = *_queues[i];
+            std::lock_guard<std::mutex> lk(q.m);
+            if(!q.tasks.empty()){
+                task = std::move(q.tasks.back());
+                q.tasks.pop_back();
+                return true;
+            }
+        }
+
+        for(std::size_t k = 1; k < _queues.size(); ++k){
+            auto& q = *_queues[(i + k) % _queues.size()];
+            std::lock_guard<std::mutex> lk(q.m);
+            if(!q.tasks.empty()){
+                task = std::move(q.tasks.front());
+                q.tasks.pop_front();
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+
+    void run(std::size_t i)
+    {
+        current() = Current{this, i};
+
+        while(1){
+            {
+                std::unique_lock<std::mutex> lk(_m);
+                _cvWork.wait(lk, [&]{ return _stop || _nQueued > 0; });
+                if(_stop && _nQueued == 0)
+                    return;
+            }
+
+            std::function<void()> task;
+            if(!try_pop(i, task))
+                continue;
+
+            {
+                std::lock_guard<std::mutex> lk(_m);
+                --_nQueued;
+            }
+
+            try{
+                task();
+            }
+            catch(...){
+                std::lock_guard<std::mutex> lk(_m);
+                if(!_error)
+                    _error = std::current_exception();
+            }
+
+            if(--_nPending == 0){
+                std::lock_guard<std::mutex> lk(_m);
+                _cvDone.notify_all();
+            }
+        }
+    }
+
+
+    std::vector<std::unique_ptr<Queue>> _queues;
+    std::vector<std::thread> _workers;
+
+    std::mutex _m;
+    std::condition_variable _cvWork, _cvDone;
+    std::size_t _nQueued;                   // キューに積まれている仕事の数(_mで保護)
+    std::atomic<std::size_t> _nPending;     // 終わっていない仕事の数
+    std::atomic<std::size_t> _next;
+    bool _stop;
+    std::exception_ptr _error;
+};
+
+
+/** 受け付ける仕事の数に上限のあるスレッドプール
+キューがいっぱいのときや、同じkeyの仕事が待っているか実行中のときは、submitは仕事を受け付けずに戻ります。
+呼び出し側(UIスレッド)を待たせないために、ブロックはしません。
+破棄されるときは、キューに残っている仕事もすべて終わるまで待ちます。
+仕事が投げた例外は書き出してから捨て、failedで数えます。
+*/
+template <typename Key>
+class BoundedJobPool
+{
+  public:
+    enum class Submitted
+    {
+        accepted,
+        duplicate,      // 同じkeyの仕事が待っているか実行中
+        full,           // キューがいっぱい
+    };
+
+
+    BoundedJobPool(std::size_t nThreads, std::size_t capacity)
+    : _capacity(capacity), _jobs(), _running(), _nFinished(0), _nFailed(0), _lastLatency(0), _stop(false), _workers()
+    {
+        if(nThreads == 0)
+            nThreads = 1;
+
+        for(std::size_t i = 0; i < nThreads; ++i)
+            _workers.emplace_back([this](){ run(); });
+    }
+
+
+    ~BoundedJobPool()
+    {
+        {
+            std::lock_guard<std::mutex> lk(_m);
+            _stop = true;
+        }
+        _cv.notify_all();
+
+        for(auto& th: _workers)
+            th.join();
+    }
+
+
+    BoundedJobPool(BoundedJobPool const &) = delete;
+    BoundedJobPool& operator=(BoundedJobPool const &) = delete;
+
+
+    template <typename F>
+    Submitted submit(Key const & key, F&& f)
+    {
+        {
+            std::lock_guard<std::mutex> lk(_m);
+
+            auto sameKey = [&](Job const & j){ return j.key == key; };
+            if(std::any_of(_jobs.begin(), _jobs.end(), sameKey) || std::any_of(_running.begin(), _running.end(), sameKey))
+                return Submitted::duplicate;
+
+            if(_jobs.size() >= _capacity)
+                return Submitted::full;
+
+            _jobs.push_back(Job{key, std::function<void()>(std::forward<F>(f)), Clock::now()});
+        }
+        _cv.notify_one();
+
+        return Submitted::accepted;
+    }
+
+
+    std::size_t queued() const { std::lock_guard<std::mutex> lk(_m); return _jobs.size(); }
+    std::size_t running() const { std::lock_guard<std::mutex> lk(_m); return _running.size(); }
+    std::size_t finished() const { std::lock_guard<std::mutex> lk(_m); return _nFinished; }
+    std::size_t failed() const { std::lock_guard<std::mutex> lk(_m); return _nFailed; }
+
+
+    /** 最後に終わった仕事の、submitされてから終わるまでの秒数
+    */
+    double last_latency() const { std::lock_guard<std::mutex> lk(_m); return _lastLatency; }
+
+
+  private:
+    using Clock = std::chrono::steady_clock;
+
+    struct Job
+    {
+        Key key;
+        std::function<void()> task;
+        Clock::time_point submitted;
+    };
+
+
+    void run()
+    {
+        while(1){
+            typename std::list<Job>::iterator it;
+            {
+                std::unique_lock<std::mutex> lk(_m);
+                _cv.wait(lk, [&]{ return _stop || !_jobs.empty(); });
+                if(_jobs.empty())
+                    return;
+
+                _running.splice(_running.end(), _jobs, _jobs.begin());
+                it = std::prev(_running.end());
+            }
+
+            bool ok = true;
+            try{
+                it->task();
+            }
+            catch(std::exception& ex){
+                utils::writeln(std::string("Error: a submitted job failed: ") + ex.what());
+                ok = false;
+            }
+            catch(...){
+                utils::writeln("Error: a submitted job failed with an unknown exception");
+                ok = false;
+            }
+
+            std::lock_guard<std::mutex> lk(_m);
+            _lastLatency = std::chrono::duration<double>(Clock::now() - it->submitted).count();
+            ++_nFinished;
+            if(!ok) ++_nFailed;
+            _running.erase(it);
+        }
+    }
+
+
+    std::size_t _capacity;
+
+    mutable std::mutex _m;
+    std::condition_variable _cv;
+    std::list<Job> _jobs;           // 待っている仕事
+    std::list<Job> _running;        // 実行中の仕事
+    std::size_t _nFinished, _nFailed;
+    double _lastLatency;
+    bool _stop;
+
+    std::vector<std::thread> _workers;
+};
+
+
+}}
@@ -0,0 +1,162 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <memory>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include <opencv2/opencv.hpp>
+
+#include "../utils/include/types.hpp"
+#include "../utils/include/image.hpp"
+#include "../utils/include/exception.hpp"
+#include "grid.hpp"
+
+
+namespace procon { namespace modify {
+
+
+/** 断片の画素を持つ、読み出し専用の元画像
+元画像は一枚だけ持ち、各断片はその中の領域を指すcv::Mat(ヘッダだけで、画素は複製しない)として引きます。
+複数のArrangedImageから共有されるので、画素を書き換えないでください。
+*/
+class TileAtlas
+{
+  public:
+    /** indexの並びで一度だけ合成し、それを元画像にします
+    */
+    TileAtlas(utils::DividedImage const & img, std::vector<std::vector<utils::ImageID>> const & index)
+    : _source(utils::SwappedImage(img, index).cvMat()),
+      _divY(img.div_y()), _divX(img.div_x()),
+      _tiles()
+    {
+        PROCON_ENFORCE(index.size() == _divY && !index.empty() && index[0].size() == _divX,
+                       "Error: the index does not match the divided image.");
+
+        const int w = static_cast<int>(tile_width()),
+                  h = static_cast<int>(tile_height());
+
+        for(std::size_t i = 0; i < _divY; ++i)
+            for(std::size_t j = 0; j < _divX; ++j)
+                _tiles.emplace(index[i][j], _source(cv::Rect(j * w, i * h, w, h)));
+    }
+
+
+    TileAtlas(TileAtlas const &) = delete;
+    TileAtlas& operator=(TileAtlas const &) = delete;
+
+
+    cv::Mat const & tile(utils::ImageID id) const { return _tiles.at(id); }
+
+
+    std::size_t div_y() const { return _divY; }
+    std::size_t div_x() const { return _divX; }
+    std::size_t width() const { return _source.cols; }
+    std::size_t height() const { return _source.rows; }
+    std::size_t tile_width() const { return width() / _divX; }
+    std::size_t tile_height() const { return height() / _divY; }
+    int type() const { return _source.type(); }
+
+
+  private:
+    cv::Mat _source;
+    std::size_t _divY, _divX;
+    std::unordered_map<utils::ImageID, cv::Mat> _tiles;
+};
+
+
+/** 共有された元画像と、各位置にどの断片を置くかの並びの組
+入れ替えは並びを書き換えるだけで、画素は表示用に合成するときに元画像から参照で引きます。
+
+画像全体のずらし(ローテーション)は並びを書き換えず、行と列のずれの量だけを変えます。
+引数の位置(i, j)はすべてずらした後の位置で、並びの中ではphysical(i, j)にあります。
+*/
+class ArrangedImage
+{
+  public:
+    ArrangedImage(std::shared_ptr<TileAtlas const> atlas, Grid<utils::ImageID> const & index)
+    : _atlas(std::move(atlas)), _index(index), _offset{{0, 0}}, _view(), _viewValid(false) {}
+
+
+    /** ずらした後の並びを返します。
+    ずれがあれば、前回から変更があったときだけ並びを作り直します。
+    */
+    Grid<utils::ImageID> const & get_index() const
+    {
+        if(_offset[0] == 0 && _offset[1] == 0)
+            return _index;
+
+        if(!_viewValid){
+            _view = _index;
+            for(std::size_t i = 0; i < div_y(); ++i)
+                for(std::size_t j = 0; j < div_x(); ++j)
+                    _view(i, j) = at(i, j);
+
+            _viewValid = true;
+        }
+
+        return _view;
+    }
+
+
+    utils::Index2D physical(std::size_t i, std::size_t j) const
+    {
+        return utils::makeIndex2D((i + _offset[0]) % div_y(), (j + _offset[1]) % div_x());
+    }
+
+
+    utils::ImageID at(std::size_t i, std::size_t j) const
+    {
+        const auto p = physical(i, j);
+        return _index[p];
+    }
+
+
+    void swap_element(utils::Index2D const & idx1, utils::Index2D const & idx2)
+    {
+        const auto p = physical(idx1[0], idx1[1]),
+                   q = physical(idx2[0], idx2[1]);
+
+        std::swap(_index[p], _index[q]);
+        _viewValid = false;
+    }
+
+
+    /** 画像全体を一つずらします。
+    isRowなら行方向、forwardなら先頭の行(列)が末尾へ移動します。
+    */
+    void shift(bool isRow, bool forward)
+    {
+        const std::size_t n = isRow ? div_y() : div_x();
+        std::size_t& o = _offset[isRow ? 0 : 1];
+
+        o = (o + (forward ? 1 : n - 1)) % n;
+        _viewValid = false;
+    }
+
+
+    /** (i, j)に置かれている断片の画素
+    */
+    cv::Mat const & tile(std::size_t i, std::size_t j) const { return _atlas->tile(at(i, j)); }
+
+
+    std::shared_ptr<TileAtlas const> const & atlas() const { return _atlas; }
+
+    std::size_t div_y() const { return _atlas->div_y(); }
+    std::size_t div_x() const { return _atlas->div_x(); }
+    std::size_t width() const { return _atlas->width(); }
+    std::size_t height() const { return _atlas->height(); }
+
+
+  private:
+    std::shared_ptr<TileAtlas const> _atlas;
+    Grid<utils::ImageID> _index;
+    std::array<std::size_t, 2> _offset;     // 行と列のずれ
+
+    mutable Grid<utils::ImageID> _view;     // get_indexが返すずらした後の並び
+    mutable bool _viewValid;
+};
+
+
+}}
@@ -0,0 +1,220 @@
+#pragma once
+
+/** 計測用のマクロ
+PROCON_MODIFY_TRACEを定義してコンパイルしたときだけ有効になり、
+定義しなければ何も生成されません。
+
+    PROCON_TRACE_SCOPE(name)        そのスコープの実行時間を記録する
+    PROCON_TRACE_COUNT(name, n)     カウンタnameにnを足す
+    PROCON_TRACE_VALUE(name, v)     その時点の値vを記録する
+    PROCON_TRACE_COUNTERS()         その時点のすべてのカウンタの値を記録する
+    PROCON_TRACE_EXPORT(path)       記録をChromeのtrace event形式(chrome://tracing)でpathに書き出す
+
+nameには文字列リテラルを与えてください。
+*/
+
+#ifdef PROCON_MODIFY_TRACE
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <list>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+
+namespace procon { namespace modify { namespace trace {
+
+
+struct Event
+{
+    char const * name;
+    char phase;             // 'X': 区間, 'C': 値
+    double ts, dur;         // マイクロ秒
+    double value;
+};
+
+
+/** 記録を集めるシングルトン
+区間と値はスレッドごとのバッファに積むので、記録の際にロックは取りません。
+カウンタは呼び出し箇所ごとに一度だけ名前で引き、以降はアトミックな加算だけを行います。
+*/
+class Tracer
+{
+  public:
+    static Tracer& instance()
+    {
+        static Tracer t;
+        return t;
+    }
+
+
+    double now() const
+    {
+        return std::chrono::duration<double, std::micro>(Clock::now() - _start).count();
+    }
+
+
+    void push(Event const & e) { buffer().events.push_back(e); }
+
+
+    void sample(char const * name, double v) { push(Event{name, 'C', now(), 0, v}); }
+
+
+    std::atomic<std::uint64_t>& counter(char const * name)
+    {
+        std::lock_guard<std::mutex> lk(_m);
+        for(auto& c: _counters)
+            if(std::strcmp(c.name, name) == 0)
+                return c.value;
+
+        _counters.emplace_back(name);
+        return _counters.back().value;
+    }
+
+
+    void sample_counters()
+    {
+        // sampleは初回にバッファの登録でロックを取るので、値を集めてから記録する
+        std::vector<std::pair<char const *, double>> vs;
+        {
+            std::lock_guard<std::mutex> lk(_m);
+            for(auto& c: _counters)
+                vs.emplace_back(c.name, c.value.load(std::memory_order_relaxed));
+        }
+
+        for(auto& v: vs)
+            sample(v.first, v.second);
+    }
+
+
+    /** 記録を書き出します。
+    ほかのスレッドが記録している最中には呼ばないでください。
+    */
+    void write_chrome_trace(std::string const & path)
+    {
+        sample_counters();
+
+        std::lock_guard<std::mutex> lk(_m);
+        std::ofstream os(path);
+        os << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+
+        bool first = true;
+        for(auto& b: _buffers)
+            for(auto& e: b.events){
+                os << (first ? "" : ",\n");
+                first = false;
+
+                os << "{\"name\": \"" << e.name << "\", \"ph\": \"" << e.phase << "\", \"pid\": 1, \"tid\": " << b.tid
+                   << ", \"ts\": " << e.ts;
+
+                if(e.phase == 'X') os << ", \"dur\": " << e.dur << "}";
+                else               os << ", \"args\": {\"value\": " << e.value << "}}";
+            }
+
+        os << "\n]}\n";
+    }
+
+
+  private:
+    using Clock = std::chrono::steady_clock;
+
+    struct Buffer
+    {
+        explicit Buffer(std::uint32_t id) : tid(id), events() {}
+
+        std::uint32_t tid;
+        std::vector<Event> events;
+    };
+
+
+    struct Counter
+    {
+        explicit Counter(char const * n) : name(n), value(0) {}
+
+        char const * name;
+        std::atomic<std::uint64_t> value;
+    };
+
+
+    Tracer() : _start(Clock::now()) {}
+
+
+    Buffer& buffer()
+    {
+        thread_local Buffer* b = nullptr;
+        if(!b){
+            std::lock_guard<std::mutex> lk(_m);
+            _buffers.emplace_back(static_cast<std::uint32_t>(_buffers.size()));
+            b = &_buffers.back();
+        }
+
+        return *b;
+    }
+
+
+    Clock::time_point _start;
+    std::mutex _m;
+    std::list<Buffer> _buffers;
+    std::list<Counter> _counters;
+};
+
+
+class ScopedTimer
+{
+  public:
+    explicit ScopedTimer(char const * name) : _name(name), _begin(Tracer::instance().now()) {}
+
+    ~ScopedTimer()
+    {
+        auto& t = Tracer::instance();
+        const double end = t.now();
+        t.push(Event{_name, 'X', _begin, end - _begin, 0});
+    }
+
+    ScopedTimer(ScopedTimer const &) = delete;
+    ScopedTimer& operator=(ScopedTimer const &) = delete;
+
+  private:
+    char const * _name;
+    double _begin;
+};
+
+
+}}}
+
+
+#define PROCON_TRACE_CONCAT_IMPL(a, b) a##b
+#define PROCON_TRACE_CONCAT(a, b) PROCON_TRACE_CONCAT_IMPL(a, b)
+
+#define PROCON_TRACE_SCOPE(name) \
+    ::procon::modify::trace::ScopedTimer PROCON_TRACE_CONCAT(procon_trace_scope_, __LINE__)(name)
+
+#define PROCON_TRACE_COUNT(name, n) do{ \
+        static auto& procon_trace_counter_ = ::procon::modify::trace::Tracer::instance().counter(name); \
+        procon_trace_counter_.fetch_add((n), std::memory_order_relaxed); \
+    }while(0)
+
+#define PROCON_TRACE_VALUE(name, v) (::procon::modify::trace::Tracer::instance().sample((name), (v)))
+#define PROCON_TRACE_COUNTERS() (::procon::modify::trace::Tracer::instance().sample_counters())
+#define PROCON_TRACE_EXPORT(path) (::procon::modify::trace::Tracer::instance().write_chrome_trace(path))
+
+#else
+
+#define PROCON_TRACE_SCOPE(name) ((void)0)
+#define PROCON_TRACE_COUNT(name, n) ((void)0)
+#define PROCON_TRACE_VALUE(name, v) ((void)0)
+#define PROCON_TRACE_COUNTERS() ((void)0)
+#define PROCON_TRACE_EXPORT(path) ((void)0)
+
+#endif
+
+
+// modify_guess_imageの終了時に書き出すファイル
+#ifndef PROCON_MODIFY_TRACE_FILE
+#define PROCON_MODIFY_TRACE_FILE "modify_trace.json"
+#endif
@@ -0,0 +1,173 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <tuple>
+#include <vector>
+
+#include "cost_table.hpp"
+#include "grid.hpp"
+
+
+namespace procon { namespace modify {
+
+
+/** 配置の途中の地図から、その先の探索結果を引くための表
+キーは地図の各マスの断片から作るZobrist式のハッシュ値で、衝突に備えて地図そのものも比べます。
+表は大きさの決まった直接写像で、同じ位置に別の地図が来たら上書きします。
+
+一回の探索の中では同じ地図に二度出会うことはほとんどないので、
+当たるのは主に、同じ状態で推定をやり直したときや、ビームサーチで幅を広げて探索し直したときです。
+結果は評価関数(CostTable)ごとに異なるので、表は評価関数ごとに用意してください。
+*/
+class TranspositionTable
+{
+  public:
+    struct Stats
+    {
+        std::size_t lookups, hits, stores, evictions;
+        std::size_t bytes;      // 登録されている項目が使っているおおよそのバイト数
+
+        double hit_rate() const { return lookups ? static_cast<double>(hits) / lookups : 0; }
+    };
+
+
+    /** maxBytesは表が使うメモリのおおよその上限です
+    */
+    explicit TranspositionTable(std::size_t maxBytes)
+    : _maxBytes(maxBytes), _slots(), _locks(nLocks), _statsLock(), _stats(Stats{0, 0, 0, 0, 0}) {}
+
+
+    TranspositionTable(TranspositionTable const &) = delete;
+    TranspositionTable& operator=(TranspositionTable const &) = delete;
+
+
+    /** (cell, tile)に対応する乱数を、表を持たずにsplitmix64で作ります
+    */
+    static std::uint64_t zobrist(std::uint64_t cell, std::uint64_t tile)
+    {
+        std::uint64_t z = (cell << 16 | tile) + 0x9e3779b97f4a7c15ULL;
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        return z ^ (z >> 31);
+    }
+
+
+    /** 地図と、まだ置かれていない断片の集合のハッシュ値
+    */
+    static std::uint64_t hash(Grid<TileNo> const & map, std::vector<TileNo> const & remain, TileNo noTile)
+    {
+        std::uint64_t h = zobrist(map.rows(), map.cols());
+        for(std::size_t k = 0; k < map.size(); ++k)
+            if(map[k] != noTile)
+                h ^= zobrist(k + 1, map[k]);
+
+        for(auto t: remain)
+            h ^= zobrist(0, t);
+
+        return h;
+    }
+
+
+    bool find(std::uint64_t h, Grid<TileNo> const & key, double& value, Grid<TileNo>& result)
+    {
+        bool hit = false;
+        if(allocate(entry_bytes(key))){
+            const std::size_t i = h % _slots.size();
+            std::lock_guard<std::mutex> lk(_locks[i % nLocks]);
+
+            auto& s = _slots[i];
+            if(s.used && s.hash == h && s.key == key){
+                value = s.value;
+                result = s.result;
+                hit = true;
+            }
+        }
+
+        std::lock_guard<std::mutex> lk(_statsLock);
+        ++_stats.lookups;
+        if(hit) ++_stats.hits;
+        return hit;
+    }
+
+
+    void store(std::uint64_t h, Grid<TileNo> const & key, double value, Grid<TileNo> const & result)
+    {
+        const std::size_t entryBytes = entry_bytes(key);
+        if(!allocate(entryBytes))
+            return;
+
+        const std::size_t i = h % _slots.size();
+        bool evicted = false, added = false;
+        {
+            std::lock_guard<std::mutex> lk(_locks[i % nLocks]);
+            auto& s = _slots[i];
+            evicted = s.used && !(s.hash == h && s.key == key);
+            added = !s.used;
+
+            s.used = true;
+            s.hash = h;
+            s.key = key;
+            s.value = value;
+            s.result = result;
+        }
+
+        std::lock_guard<std::mutex> lk(_statsLock);
+        ++_stats.stores;
+        if(evicted) ++_stats.evictions;
+        if(added) _stats.bytes += entryBytes;
+    }
+
+
+    Stats stats() const
+    {
+        std::lock_guard<std::mutex> lk(_statsLock);
+        return _stats;
+    }
+
+
+  private:
+    static constexpr std::size_t nLocks = 64;
+
+    struct Slot
+    {
+        Slot() : used(false), hash(0), key(), value(0), result() {}
+
+        bool used;
+        std::uint64_t hash;
+        Grid<TileNo> key;
+        double value;
+        Grid<TileNo> result;
+    };
+
+
+    // 一項目は、キーと結果の二つの地図を持つ
+    static std::size_t entry_bytes(Grid<TileNo> const & key)
+    {
+        return sizeof(Slot) + 2 * key.size() * sizeof(TileNo);
+    }
+
+
+    // 最初に使うときに、一項目の大きさから表の大きさを決める
+    bool allocate(std::size_t entryBytes)
+    {
+        std::call_once(_allocated, [&]{
+            const std::size_t n = _maxBytes / entryBytes;
+            if(n) _slots.resize(n);
+        });
+
+        return !_slots.empty();
+    }
+
+
+    std::size_t _maxBytes;
+    std::once_flag _allocated;
+    std::vector<Slot> _slots;
+    std::vector<std::mutex> _locks;
+    mutable std::mutex _statsLock;
+    Stats _stats;
+};
+
+
+}}